@@ -30,10 +30,13 @@ void ofApp::setup(){
 void ofApp::update(){
     pipewire.update();
 
-    generatePublishFrame();
-    pipewire.submitFrame(publishPixels);
-
-    publishTex.loadData(publishPixels);
+    // Zero-copy writes the pattern straight into the PipeWire buffer; the
+    // fallback renders into publishPixels and lets the addon convert it.
+    if(!zeroCopy || !publishZeroCopy()){
+        generatePublishFrame();
+        pipewire.submitFrame(publishPixels);
+        publishTex.loadData(publishPixels);
+    }
 
     if(pipewire.getLatestFrame(capturedPixels)){
         if(!captureTex.isAllocated()){
@@ -60,35 +63,45 @@ void ofApp::draw(){
         ofDrawBitmapStringHighlight("Waiting for capture stream...", 40 + w, 40);
     }
 
-    ofDrawBitmapStringHighlight("Publish", 20, 20 + h + 20);
+    ofDrawBitmapStringHighlight(zeroCopy ? "Publish (zero-copy, z to toggle)" : "Publish (z to toggle)", 20, 20 + h + 20);
     ofDrawBitmapStringHighlight("Capture", 40 + w, 20 + h + 20);
 
+    // The snapshot is shared, not copied; the lines are only rebuilt when the graph changed.
+    auto discovery = pipewire.getDiscoverySnapshot();
+    if(discovery->generation != listedGeneration){
+        listedGeneration = discovery->generation;
+        nodeLines.clear();
+        for(const auto* node : discovery->getVideoNodes()){
+            if(static_cast<int>(nodeLines.size()) >= maxListCount){
+                break;
+            }
+            nodeLines.push_back(formatNodeLine(*node));
+        }
+        portLines.clear();
+        for(const auto& port : discovery->ports){
+            if(static_cast<int>(portLines.size()) >= maxListCount){
+                break;
+            }
+            portLines.push_back(formatPortLine(port));
+        }
+    }
+
     float listTop = 20.0f + h + 60.0f;
     ofDrawBitmapStringHighlight("Video Nodes (first " + ofToString(maxListCount) + ")", 20, listTop);
 
-    auto nodes = pipewire.getVideoNodes();
     float y = listTop + 18.0f;
-    int count = 0;
-    for(const auto& node : nodes){
-        ofDrawBitmapString(formatNodeLine(node), 20, y);
+    for(const auto& line : nodeLines){
+        ofDrawBitmapString(line, 20, y);
         y += 14.0f;
-        if(++count >= maxListCount){
-            break;
-        }
     }
 
     y += 10.0f;
     ofDrawBitmapStringHighlight("Ports (first " + ofToString(maxListCount) + ")", 20, y);
     y += 18.0f;
 
-    auto ports = pipewire.getPorts();
-    count = 0;
-    for(const auto& port : ports){
-        ofDrawBitmapString(formatPortLine(port), 20, y);
+    for(const auto& line : portLines){
+        ofDrawBitmapString(line, 20, y);
         y += 14.0f;
-        if(++count >= maxListCount){
-            break;
-        }
     }
 
     if(!pipewireReady){
@@ -100,6 +113,12 @@ void ofApp::exit(){
     pipewire.shutdown();
 }
 
+void ofApp::keyPressed(int key){
+    if(key == 'z'){
+        zeroCopy = !zeroCopy;
+    }
+}
+
 void ofApp::generatePublishFrame(){
     if(!publishPixels.isAllocated()){
         return;
@@ -107,24 +126,62 @@ void ofApp::generatePublishFrame(){
 
     int w = publishPixels.getWidth();
     int h = publishPixels.getHeight();
+    writePattern(publishPixels.getData(), w, h, w * 4, 0, 2);
+}
+
+bool ofApp::publishZeroCopy(){
+#ifdef TARGET_LINUX
+    ofxPipeWire::PublishBuffer buffer = pipewire.acquirePublishBuffer();
+    if(!buffer.isValid()){
+        return false;
+    }
+
+    ofxPipeWireConvert::PackedLayout layout;
+    if(!ofxPipeWireConvert::getPackedLayout(buffer.format, layout) || layout.bytesPerPixel != 4){
+        // Draw the pattern in RGBA, then convert it straight into the buffer's planes.
+        if(publishPixels.getWidth() != buffer.width || publishPixels.getHeight() != buffer.height){
+            publishPixels.allocate(buffer.width, buffer.height, OF_PIXELS_RGBA);
+        }
+        generatePublishFrame();
+
+        ofxPipeWireConvert::ConstPlanes src;
+        src.data[0] = publishPixels.getData();
+        src.stride[0] = buffer.width * 4;
+        ofxPipeWireConvert::Planes dst;
+        for(int i = 0; i < buffer.planeCount; ++i){
+            dst.data[i] = buffer.planeData[i];
+            dst.stride[i] = buffer.planeStride[i];
+        }
+        ofxPipeWireConvert::getFrameConverter(SPA_VIDEO_FORMAT_RGBA, buffer.format).convert(src, dst, buffer.width, buffer.height);
+        return pipewire.commitPublishBuffer(buffer);
+    }
+
+    bool bgr = buffer.format == SPA_VIDEO_FORMAT_BGRA || buffer.format == SPA_VIDEO_FORMAT_BGRx;
+    writePattern(buffer.data, buffer.width, buffer.height, buffer.stride, bgr ? 2 : 0, bgr ? 0 : 2);
+    return pipewire.commitPublishBuffer(buffer);
+#else
+    return false;
+#endif
+}
 
+void ofApp::writePattern(uint8_t* data, int w, int h, int stride, int redOffset, int blueOffset) const{
     float t = ofGetElapsedTimef() - timeStart;
-    uint8_t* data = publishPixels.getData();
 
     for(int y = 0; y < h; ++y){
         float v = static_cast<float>(y) / static_cast<float>(h);
+        uint8_t* row = data + y * stride;
         for(int x = 0; x < w; ++x){
             float u = static_cast<float>(x) / static_cast<float>(w);
-            int i = (y * w + x) * 4;
+            int i = x * 4;
 
             float r = 0.5f + 0.5f * sinf(t + u * 6.2831f);
             float g = 0.5f + 0.5f * sinf(t * 0.7f + v * 6.2831f);
             float b = 0.5f + 0.5f * sinf(t * 1.3f + (u + v) * 3.1415f);
 
-            data[i + 0] = static_cast<uint8_t>(r * 255.0f);
-            data[i + 1] = static_cast<uint8_t>(g * 255.0f);
-            data[i + 2] = static_cast<uint8_t>(b * 255.0f);
-            data[i + 3] = 255;
+            row[i + redOffset] = static_cast<uint8_t>(r * 255.0f);
+            row[i + 1] = static_cast<uint8_t>(g * 255.0f);
+            row[i + blueOffset] = static_cast<uint8_t>(b * 255.0f);
+            row[i + 3] = 255;
         }
     }
 }
@@ -9,9 +9,12 @@ public:
     void update();
     void draw();
     void exit();
+    void keyPressed(int key);
 
 private:
     void generatePublishFrame();
+    bool publishZeroCopy();
+    void writePattern(uint8_t* data, int w, int h, int stride, int redOffset, int blueOffset) const;
     std::string formatNodeLine(const ofxPipeWire::NodeInfo& node) const;
     std::string formatPortLine(const ofxPipeWire::PortInfo& port) const;
 
@@ -26,6 +29,10 @@ private:
 
     float timeStart = 0.0f;
     bool pipewireReady = false;
+    bool zeroCopy = true;
 
     int maxListCount = 12;
+    uint64_t listedGeneration = 0;
+    std::vector<std::string> nodeLines;
+    std::vector<std::string> portLines;
 };
@@ -31,17 +31,6 @@ void ofApp::update(){
         }
     }
 
-    if(pendingReconnect){
-        pendingReconnect = false;
-        pipewire.shutdown();
-        pipewireReady = pipewire.setup(false, true, config);
-        if(pipewireReady){
-            status = "Targeting: " + targetName;
-        }else{
-            status = "Reconnection failed";
-        }
-    }
-
     if(pipewire.getLatestFrame(capturedPixels)){
         if(!captureTex.isAllocated()){
             captureTex.allocate(capturedPixels.getWidth(), capturedPixels.getHeight(), GL_RGBA);
@@ -143,7 +132,8 @@ void ofApp::connectToTarget(int index){
 
     targetIndex = index;
     targetName = targets[index].name.empty() ? "Unknown" : targets[index].name;
+    // Only the capture stream reconnects; the last frame stays up until the new source delivers.
     pipewire.setCaptureTargetNodeName(targetName);
-    pendingReconnect = true;
+    status = "Targeting: " + targetName;
     targetSelected = true;
 }
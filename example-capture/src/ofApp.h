@@ -31,5 +31,4 @@ private:
     std::string status;
     bool pipewireReady = false;
     bool targetSelected = false;
-    bool pendingReconnect = false;
 };
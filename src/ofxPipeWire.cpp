@@ -1,8 +1,10 @@
 #include "ofxPipeWire.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 #ifdef TARGET_LINUX
 #include <spa/utils/defs.h>
@@ -11,6 +13,7 @@
 ofxPipeWire::ofxPipeWire() = default;
 
 ofxPipeWire::~ofxPipeWire(){
+    liveness.reset();
     shutdown();
 }
 
@@ -32,24 +35,104 @@ void ofxPipeWire::setNodeName(const std::string& name){
 
 void ofxPipeWire::setPreferredVideoFormats(const std::vector<VideoFormatPreference>& formats){
 #ifdef TARGET_LINUX
+    std::vector<std::vector<spa_video_format>> offered;
+    for(const auto& stream : videoStreams){
+        offered.push_back(getOfferedFormats(*stream));
+    }
+
     preferredFormats = formats;
     if(preferredFormats.empty()){
         preferredFormats = {VideoFormatPreference::RGBA, VideoFormatPreference::BGRA,
                             VideoFormatPreference::RGBx, VideoFormatPreference::BGRx};
     }
-    if(initialized){
-        ofLogNotice("ofxPipeWire") << "Preferred formats updated. Call shutdown/setup to renegotiate.";
+
+    // Only streams whose offer actually changed go through a renegotiation.
+    for(size_t i = 0; initialized && i < videoStreams.size(); ++i){
+        VideoStream& stream = *videoStreams[i];
+        if(getOfferedFormats(stream) != offered[i]){
+            renegotiateVideoStream(stream, stream.config);
+        }
     }
 #else
     (void)formats;
 #endif
 }
 
+void ofxPipeWire::setLoopMode(LoopMode mode){
+#ifdef TARGET_LINUX
+    loopMode = mode;
+    if(initialized){
+        ofLogNotice("ofxPipeWire") << "Loop mode updated. Call shutdown/setup to apply.";
+    }
+#else
+    (void)mode;
+#endif
+}
+
+void ofxPipeWire::setCaptureMode(CaptureMode mode){
+#ifdef TARGET_LINUX
+    pendingCaptureMode = mode;
+    if(initialized){
+        ofLogNotice("ofxPipeWire") << "Capture mode updated. Call shutdown/setup to apply.";
+    }
+#else
+    (void)mode;
+#endif
+}
+
+void ofxPipeWire::setCaptureOutputFormat(ofPixelFormat format){
+#ifdef TARGET_LINUX
+    if(toSpaFormat(format) == SPA_VIDEO_FORMAT_UNKNOWN){
+        ofLogWarning("ofxPipeWire") << "Unsupported capture output format; keeping the current one";
+        return;
+    }
+    pendingCaptureOutputFormat = format;
+    if(initialized){
+        ofLogNotice("ofxPipeWire") << "Capture output format updated. Call shutdown/setup to apply.";
+    }
+#else
+    (void)format;
+#endif
+}
+
+void ofxPipeWire::setPublishOnlyOnChange(bool onlyOnChange){
+#ifdef TARGET_LINUX
+    publishOnlyOnChange = onlyOnChange;
+#else
+    (void)onlyOnChange;
+#endif
+}
+
+void ofxPipeWire::setAudioEnabled(bool enablePublish, bool enableCapture){
+#ifdef TARGET_LINUX
+    audioPublishEnabled = enablePublish;
+    audioCaptureEnabled = enableCapture;
+    if(initialized){
+        ofLogNotice("ofxPipeWire") << "Audio streams updated. Call shutdown/setup to apply.";
+    }
+#else
+    (void)enablePublish;
+    (void)enableCapture;
+#endif
+}
+
+void ofxPipeWire::setAudioConfig(const AudioConfig& config){
+#ifdef TARGET_LINUX
+    audioConfig = config;
+    audioConfig.channels = std::min(std::max(config.channels, 1), static_cast<int>(maxAudioChannels));
+    if(initialized){
+        ofLogNotice("ofxPipeWire") << "Audio config updated. Call shutdown/setup to apply.";
+    }
+#else
+    (void)config;
+#endif
+}
+
 void ofxPipeWire::setPublishTargetNodeName(const std::string& targetName){
 #ifdef TARGET_LINUX
     publishTargetObject = targetName;
-    if(initialized){
-        ofLogNotice("ofxPipeWire") << "Publish target updated. Call shutdown/setup to reconnect.";
+    if(VideoStream* stream = initialized ? findStream(defaultPublishStream) : nullptr){
+        retargetVideoStream(*stream, publishTargetObject);
     }
 #else
     (void)targetName;
@@ -59,8 +142,8 @@ void ofxPipeWire::setPublishTargetNodeName(const std::string& targetName){
 void ofxPipeWire::setPublishTargetObjectSerial(const std::string& objectSerial){
 #ifdef TARGET_LINUX
     publishTargetObject = objectSerial;
-    if(initialized){
-        ofLogNotice("ofxPipeWire") << "Publish target updated. Call shutdown/setup to reconnect.";
+    if(VideoStream* stream = initialized ? findStream(defaultPublishStream) : nullptr){
+        retargetVideoStream(*stream, publishTargetObject);
     }
 #else
     (void)objectSerial;
@@ -70,8 +153,8 @@ void ofxPipeWire::setPublishTargetObjectSerial(const std::string& objectSerial){
 void ofxPipeWire::setCaptureTargetNodeName(const std::string& targetName){
 #ifdef TARGET_LINUX
     captureTargetObject = targetName;
-    if(initialized){
-        ofLogNotice("ofxPipeWire") << "Capture target updated. Call shutdown/setup to reconnect.";
+    if(VideoStream* stream = initialized ? findStream(defaultCaptureStream) : nullptr){
+        retargetVideoStream(*stream, captureTargetObject);
     }
 #else
     (void)targetName;
@@ -81,45 +164,119 @@ void ofxPipeWire::setCaptureTargetNodeName(const std::string& targetName){
 void ofxPipeWire::setCaptureTargetObjectSerial(const std::string& objectSerial){
 #ifdef TARGET_LINUX
     captureTargetObject = objectSerial;
-    if(initialized){
-        ofLogNotice("ofxPipeWire") << "Capture target updated. Call shutdown/setup to reconnect.";
+    if(VideoStream* stream = initialized ? findStream(defaultCaptureStream) : nullptr){
+        retargetVideoStream(*stream, captureTargetObject);
     }
 #else
     (void)objectSerial;
 #endif
 }
 
-std::vector<ofxPipeWire::NodeInfo> ofxPipeWire::getNodes() const{
+void ofxPipeWire::setCaptureRegion(const Rect& region){
 #ifdef TARGET_LINUX
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    return nodes;
-#else
-    return {};
+    captureRegion = region;
 #endif
+    setCaptureRegion(getDefaultCaptureStream(), region);
 }
 
-std::vector<ofxPipeWire::NodeInfo> ofxPipeWire::getVideoNodes() const{
+void ofxPipeWire::setCaptureRegion(StreamHandle handle, const Rect& region){
 #ifdef TARGET_LINUX
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    std::vector<NodeInfo> result;
-    for(const auto& node : nodes){
-        if(isVideoNode(node)){
-            result.push_back(node);
-        }
+    VideoStream* stream = findStream(handle, false);
+    if(!stream){
+        return;
     }
-    return result;
+
+    LoopLock lock(threadLoop);
+    stream->captureRegion = region;
 #else
-    return {};
+    (void)handle;
+    (void)region;
 #endif
 }
 
-std::vector<ofxPipeWire::PortInfo> ofxPipeWire::getPorts() const{
+std::shared_ptr<const ofxPipeWire::DiscoverySnapshot> ofxPipeWire::getDiscoverySnapshot() const{
+    static const std::shared_ptr<const DiscoverySnapshot> empty = std::make_shared<DiscoverySnapshot>();
 #ifdef TARGET_LINUX
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    return ports;
-#else
-    return {};
+    if(connection){
+        std::lock_guard<std::mutex> lock(connection->discoveryMutex);
+        if(connection->discovery){
+            return connection->discovery;
+        }
+    }
 #endif
+    return empty;
+}
+
+std::vector<ofxPipeWire::NodeInfo> ofxPipeWire::getNodes() const{
+    return getDiscoverySnapshot()->nodes;
+}
+
+std::vector<ofxPipeWire::NodeInfo> ofxPipeWire::getVideoNodes() const{
+    std::shared_ptr<const DiscoverySnapshot> snapshot = getDiscoverySnapshot();
+    std::vector<NodeInfo> result;
+    for(const NodeInfo* node : snapshot->getVideoNodes()){
+        result.push_back(*node);
+    }
+    return result;
+}
+
+std::vector<ofxPipeWire::PortInfo> ofxPipeWire::getPorts() const{
+    return getDiscoverySnapshot()->ports;
+}
+
+const ofxPipeWire::NodeInfo* ofxPipeWire::DiscoverySnapshot::findNode(uint32_t id) const{
+    auto it = nodeIds.find(id);
+    return it != nodeIds.end() ? &nodes[it->second] : nullptr;
+}
+
+const ofxPipeWire::NodeInfo* ofxPipeWire::DiscoverySnapshot::findNodeByName(const std::string& name) const{
+    auto it = nodeNames.find(name);
+    return it != nodeNames.end() ? &nodes[it->second] : nullptr;
+}
+
+const ofxPipeWire::NodeInfo* ofxPipeWire::DiscoverySnapshot::findNodeByObjectSerial(const std::string& objectSerial) const{
+    auto it = nodeSerials.find(objectSerial);
+    return it != nodeSerials.end() ? &nodes[it->second] : nullptr;
+}
+
+std::vector<const ofxPipeWire::NodeInfo*> ofxPipeWire::DiscoverySnapshot::findNodesByMediaClass(const std::string& mediaClass) const{
+    std::vector<const NodeInfo*> result;
+    auto it = nodeMediaClasses.find(mediaClass);
+    if(it != nodeMediaClasses.end()){
+        for(size_t index : it->second){
+            result.push_back(&nodes[index]);
+        }
+    }
+    return result;
+}
+
+std::vector<const ofxPipeWire::NodeInfo*> ofxPipeWire::DiscoverySnapshot::getVideoNodes() const{
+    std::vector<const NodeInfo*> result;
+    result.reserve(videoNodes.size());
+    for(size_t index : videoNodes){
+        result.push_back(&nodes[index]);
+    }
+    return result;
+}
+
+const ofxPipeWire::PortInfo* ofxPipeWire::DiscoverySnapshot::findPort(uint32_t id) const{
+    auto it = portIds.find(id);
+    return it != portIds.end() ? &ports[it->second] : nullptr;
+}
+
+std::vector<const ofxPipeWire::PortInfo*> ofxPipeWire::DiscoverySnapshot::findPortsByNode(uint32_t nodeId) const{
+    std::vector<const PortInfo*> result;
+    auto it = nodePorts.find(nodeId);
+    if(it != nodePorts.end()){
+        for(size_t index : it->second){
+            result.push_back(&ports[index]);
+        }
+    }
+    return result;
+}
+
+bool ofxPipeWire::setup(bool enablePublish, bool enableCapture){
+    return setup(enablePublish, enableCapture, VideoConfig());
 }
 
 bool ofxPipeWire::setup(bool enablePublish, bool enableCapture, const VideoConfig& config){
@@ -128,35 +285,56 @@ bool ofxPipeWire::setup(bool enablePublish, bool enableCapture, const VideoConfi
         return true;
     }
 
-    publishEnabled = enablePublish;
-    captureEnabled = enableCapture;
     videoConfig = config;
+    captureMode = pendingCaptureMode;
+    captureOutputFormat = pendingCaptureOutputFormat;
 
     if(preferredFormats.empty()){
         preferredFormats = {VideoFormatPreference::RGBA, VideoFormatPreference::BGRA,
                             VideoFormatPreference::RGBx, VideoFormatPreference::BGRx};
     }
 
-    publishInfo = getDefaultVideoInfo();
-    captureInfo = getDefaultVideoInfo();
+    // Rings are sized once here; the realtime callbacks never allocate.
+    const size_t audioBlockFrames = 1024;
+    audioPublishRing.reset(static_cast<size_t>(std::max(audioConfig.ringFrames, 256)), audioConfig.channels);
+    audioCaptureRing.reset(static_cast<size_t>(std::max(audioConfig.ringFrames, 256)), audioConfig.channels);
+    audioPublishScratch.assign(audioBlockFrames * audioConfig.channels, 0.0f);
+    audioCaptureScratch.assign(audioBlockFrames * audioConfig.channels, 0.0f);
+    audioWriteScratch.assign(audioBlockFrames * audioConfig.channels, 0.0f);
+    audioReadScratch.assign(audioBlockFrames * audioConfig.channels, 0.0f);
+    audioPublishState.layout = 0;
+    audioCaptureState.layout = 0;
 
-    if(!publishEnabled && !captureEnabled){
-        ofLogWarning("ofxPipeWire") << "setup called with no streams enabled";
-        return false;
+    // With nothing enabled, setup only connects; streams can be added afterwards.
+    if(!enablePublish && !enableCapture && !audioPublishEnabled && !audioCaptureEnabled){
+        ofLogNotice("ofxPipeWire") << "setup called with no streams enabled; add them with addPublishStream/addCaptureStream";
     }
 
     if(!setupPipeWire()){
-        shutdown();
+        teardownPipeWire();
         return false;
     }
 
-    if(publishEnabled && !createPublishStream()){
-        shutdown();
-        return false;
+    bool streamsCreated = true;
+    if(enablePublish){
+        defaultPublishStream = addVideoStream(true, publishTargetObject, videoConfig);
+        streamsCreated = defaultPublishStream != invalidStream;
+    }
+    if(streamsCreated && enableCapture){
+        defaultCaptureStream = addVideoStream(false, captureTargetObject, videoConfig);
+        streamsCreated = defaultCaptureStream != invalidStream;
+    }
+    if(streamsCreated){
+        LoopLock lock(threadLoop);
+        if(audioPublishEnabled && !createAudioStream(true)){
+            streamsCreated = false;
+        }else if(audioCaptureEnabled && !createAudioStream(false)){
+            streamsCreated = false;
+        }
     }
 
-    if(captureEnabled && !createCaptureStream()){
-        shutdown();
+    if(!streamsCreated){
+        teardownPipeWire();
         return false;
     }
 
@@ -173,11 +351,18 @@ bool ofxPipeWire::setup(bool enablePublish, bool enableCapture, const VideoConfi
 
 void ofxPipeWire::update(){
 #ifdef TARGET_LINUX
-    if(!initialized || !mainLoop){
+    if(!initialized){
+        return;
+    }
+
+    // In thread loop mode the loop runs on its own thread; nothing to pump here.
+    if(!mainLoop){
         return;
     }
 
-    pw_main_loop_iterate(mainLoop, 0);
+    pw_loop_enter(loop);
+    pw_loop_iterate(loop, 0);
+    pw_loop_leave(loop);
 #endif
 }
 
@@ -187,16 +372,6 @@ void ofxPipeWire::shutdown(){
         return;
     }
 
-    if(publishStream){
-        pw_stream_destroy(publishStream);
-        publishStream = nullptr;
-    }
-
-    if(captureStream){
-        pw_stream_destroy(captureStream);
-        captureStream = nullptr;
-    }
-
     teardownPipeWire();
 
     initialized = false;
@@ -207,422 +382,2766 @@ bool ofxPipeWire::isInitialized() const{
     return initialized;
 }
 
-bool ofxPipeWire::submitFrame(const ofPixels& pixels){
+ofxPipeWire::StreamHandle ofxPipeWire::addPublishStream(const std::string& target, const VideoConfig& config){
 #ifdef TARGET_LINUX
-    if(!initialized || !publishEnabled || pixels.isAllocated() == false){
-        return false;
+    if(!initialized){
+        ofLogWarning("ofxPipeWire") << "addPublishStream needs setup() first";
+        return invalidStream;
     }
+    return addVideoStream(true, target, config);
+#else
+    (void)target;
+    (void)config;
+    return invalidStream;
+#endif
+}
 
-    std::lock_guard<std::mutex> lock(publishMutex);
-    ensurePublishFormat(pixels, publishInfo.valid ? publishInfo : getDefaultVideoInfo());
-    hasPublishFrame = true;
-    return true;
+ofxPipeWire::StreamHandle ofxPipeWire::addCaptureStream(const std::string& target, const VideoConfig& config){
+#ifdef TARGET_LINUX
+    if(!initialized){
+        ofLogWarning("ofxPipeWire") << "addCaptureStream needs setup() first";
+        return invalidStream;
+    }
+    return addVideoStream(false, target, config);
 #else
-    (void)pixels;
+    (void)target;
+    (void)config;
+    return invalidStream;
+#endif
+}
+
+void ofxPipeWire::removeStream(StreamHandle stream){
+#ifdef TARGET_LINUX
+    auto it = std::find_if(videoStreams.begin(), videoStreams.end(), [stream](const std::unique_ptr<VideoStream>& entry){
+        return entry->handle == stream;
+    });
+    if(it == videoStreams.end()){
+        return;
+    }
+
+    {
+        LoopLock lock(threadLoop);
+        destroyVideoStream(**it);
+    }
+    videoStreams.erase(it);
+
+    if(defaultPublishStream == stream){
+        defaultPublishStream = invalidStream;
+    }
+    if(defaultCaptureStream == stream){
+        defaultCaptureStream = invalidStream;
+    }
+#else
+    (void)stream;
+#endif
+}
+
+bool ofxPipeWire::setStreamTarget(StreamHandle handle, const std::string& target){
+#ifdef TARGET_LINUX
+    VideoStream* stream = initialized ? findStream(handle) : nullptr;
+    if(!stream){
+        return false;
+    }
+    return retargetVideoStream(*stream, target);
+#else
+    (void)handle;
+    (void)target;
     return false;
 #endif
 }
 
-bool ofxPipeWire::getLatestFrame(ofPixels& outPixels){
+bool ofxPipeWire::setStreamConfig(StreamHandle handle, const VideoConfig& config){
 #ifdef TARGET_LINUX
-    if(!initialized || !captureEnabled){
+    VideoStream* stream = initialized ? findStream(handle) : nullptr;
+    if(!stream){
+        return false;
+    }
+    if(!isSameScheduling(stream->config.tuning, config.tuning) && !updateStreamScheduling(*stream, config.tuning)){
         return false;
     }
+    if(isSameFormatRequest(stream->config, config)){
+        LoopLock lock(threadLoop);
+        stream->config = config;
+        return true;
+    }
+    return renegotiateVideoStream(*stream, config);
+#else
+    (void)handle;
+    (void)config;
+    return false;
+#endif
+}
+
+void ofxPipeWire::setVideoConfig(const VideoConfig& config){
+#ifdef TARGET_LINUX
+    videoConfig = config;
+    setStreamConfig(defaultPublishStream, config);
+    setStreamConfig(defaultCaptureStream, config);
+#else
+    (void)config;
+#endif
+}
+
+ofxPipeWire::StreamStats ofxPipeWire::getStats(StreamHandle handle) const{
+    StreamStats result;
+#ifdef TARGET_LINUX
+    const VideoStream* stream = findStream(handle);
+    if(stream){
+        result = stream->stats.getSnapshot();
+    }
+#else
+    (void)handle;
+#endif
+    return result;
+}
+
+ofxPipeWire::StreamStats ofxPipeWire::getAudioPublishStats() const{
+#ifdef TARGET_LINUX
+    return audioPublishStats.getSnapshot();
+#else
+    return StreamStats();
+#endif
+}
+
+ofxPipeWire::StreamStats ofxPipeWire::getAudioCaptureStats() const{
+#ifdef TARGET_LINUX
+    return audioCaptureStats.getSnapshot();
+#else
+    return StreamStats();
+#endif
+}
+
+ofxPipeWire::StreamTime ofxPipeWire::getStreamTime(StreamHandle handle) const{
+    StreamTime result;
+#ifdef TARGET_LINUX
+    const VideoStream* stream = findStream(handle);
+    if(!initialized || !stream || !stream->stream){
+        return result;
+    }
+
+    // pw_stream_get_time_n reads a snapshot the loop publishes, so it is safe without the loop lock.
+    pw_time time = {};
+    if(pw_stream_get_time_n(stream->stream, &time, sizeof(time)) < 0 || time.rate.denom == 0){
+        return result;
+    }
+
+    result.valid = true;
+    result.now = time.now;
+    result.rateNum = time.rate.num;
+    result.rateDenom = time.rate.denom;
+    result.ticks = time.ticks;
+    result.delay = time.delay;
+    result.delayNanos = time.delay * static_cast<int64_t>(time.rate.num) * 1000000000 / time.rate.denom;
+    result.queuedBuffers = time.queued_buffers;
+    result.availableBuffers = time.avail_buffers;
+#else
+    (void)handle;
+#endif
+    return result;
+}
+
+ofxPipeWire::StreamHandle ofxPipeWire::getDefaultPublishStream() const{
+#ifdef TARGET_LINUX
+    return defaultPublishStream;
+#else
+    return invalidStream;
+#endif
+}
+
+ofxPipeWire::StreamHandle ofxPipeWire::getDefaultCaptureStream() const{
+#ifdef TARGET_LINUX
+    return defaultCaptureStream;
+#else
+    return invalidStream;
+#endif
+}
 
-    std::lock_guard<std::mutex> lock(captureMutex);
-    if(!hasLatestFrame){
+bool ofxPipeWire::submitFrame(const ofPixels& pixels){
+    return submitFrame(getDefaultPublishStream(), pixels);
+}
+
+bool ofxPipeWire::submitFrame(StreamHandle handle, const ofPixels& pixels){
+    return submitFrame(handle, pixels, std::vector<Rect>());
+}
+
+bool ofxPipeWire::submitFrame(const ofPixels& pixels, const std::vector<Rect>& dirtyRects){
+    return submitFrame(getDefaultPublishStream(), pixels, dirtyRects);
+}
+
+bool ofxPipeWire::submitFrame(StreamHandle handle, const ofPixels& pixels, const std::vector<Rect>& dirtyRects){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, true);
+    if(!initialized || !stream || pixels.isAllocated() == false){
         return false;
     }
+    if(toSpaFormat(pixels.getPixelFormat()) == SPA_VIDEO_FORMAT_UNKNOWN){
+        ofLogWarning("ofxPipeWire") << "submitFrame needs RGBA, BGRA, RGB, BGR, GRAY, NV12 or I420 pixels";
+        return false;
+    }
+
+    Damage damage;
+    if(!dirtyRects.empty()){
+        damage.clear();
+        for(Rect rect : dirtyRects){
+            if(alignRect(rect, static_cast<int>(pixels.getWidth()), static_cast<int>(pixels.getHeight()))){
+                damage.add(rect);
+            }
+        }
+    }
+
+    // Held across the conversion so param_changed can redo the last frame without racing it.
+    {
+        std::lock_guard<std::mutex> lock(stream->publishMutex);
+        stream->lastSource = pixels;
+        convertIntoSlot(*stream, pixels, damage);
+    }
 
-    outPixels = latestFrame;
+    stream->directPublish = false;
     return true;
 #else
-    (void)outPixels;
+    (void)handle;
+    (void)pixels;
+    (void)dirtyRects;
     return false;
 #endif
 }
 
+ofxPipeWire::PublishBuffer ofxPipeWire::acquirePublishBuffer(){
+    return acquirePublishBuffer(getDefaultPublishStream());
+}
+
+ofxPipeWire::PublishBuffer ofxPipeWire::acquirePublishBuffer(StreamHandle handle){
+    PublishBuffer view;
 #ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, true);
+    if(!initialized || !stream || !stream->stream){
+        return view;
+    }
 
-bool ofxPipeWire::setupPipeWire(){
-    pw_init(nullptr, nullptr);
+    NegotiatedVideo info;
+    {
+        std::lock_guard<std::mutex> lock(stream->publishMutex);
+        info = stream->info;
+    }
+    if(!info.negotiated){
+        return view;
+    }
 
-    mainLoop = pw_main_loop_new(nullptr);
-    if(!mainLoop){
-        ofLogError("ofxPipeWire") << "Failed to create PipeWire main loop";
-        return false;
+    LoopLock lock(threadLoop);
+    pw_buffer* buffer = pw_stream_dequeue_buffer(stream->stream);
+    if(!buffer){
+        return view;
     }
 
-    context = pw_context_new(pw_main_loop_get_loop(mainLoop), nullptr, 0);
-    if(!context){
-        ofLogError("ofxPipeWire") << "Failed to create PipeWire context";
+    ofxPipeWireConvert::Planes planes;
+    if(!mapBufferPlanes(buffer->buffer, info, false, planes)){
+        ofLogWarning("ofxPipeWire") << "Dequeued publish buffer is too small for the negotiated format";
+        pw_stream_queue_buffer(stream->stream, buffer);
+        return view;
+    }
+
+    // Only a buffer actually in the app's hands stops the process callback from publishing.
+    stream->directPublish = true;
+
+    view.data = planes.data[0];
+    view.width = info.width;
+    view.height = info.height;
+    view.stride = planes.stride[0];
+    view.planeCount = info.layout.count;
+    for(int i = 0; i < info.layout.count; ++i){
+        view.planeData[i] = planes.data[i];
+        view.planeStride[i] = planes.stride[i];
+    }
+    view.stream = handle;
+    view.connectGeneration = stream->connectGeneration;
+    view.bufferEpoch = stream->bufferEpoch;
+    view.format = info.format;
+    view.buffer = buffer;
+#else
+    (void)handle;
+#endif
+    return view;
+}
+
+bool ofxPipeWire::commitPublishBuffer(PublishBuffer& buffer){
+#ifdef TARGET_LINUX
+    if(!buffer.buffer){
         return false;
     }
 
-    core = pw_context_connect(context, nullptr, 0);
-    if(!core){
-        ofLogError("ofxPipeWire") << "Failed to connect PipeWire core";
+    VideoStream* stream = findStream(buffer.stream, true);
+    if(!initialized || !stream || !stream->stream){
+        buffer = PublishBuffer();
         return false;
     }
 
-    registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
-    if(!registry){
-        ofLogError("ofxPipeWire") << "Failed to get PipeWire registry";
+    // A reconnect or format change since acquire removed the buffer; it may already be freed.
+    LoopLock lock(threadLoop);
+    if(stream->connectGeneration != buffer.connectGeneration || stream->bufferEpoch != buffer.bufferEpoch){
+        ofLogWarning("ofxPipeWire") << "Publish buffer was replaced before it was committed";
+        buffer = PublishBuffer();
         return false;
     }
 
-    static const pw_registry_events registryEvents = {
-        PW_VERSION_REGISTRY_EVENTS,
-        .global = ofxPipeWire::onRegistryGlobal,
-        .global_remove = ofxPipeWire::onRegistryGlobalRemove
-    };
+    ofxPipeWireConvert::PlaneLayout layout;
+    ofxPipeWireConvert::getPlaneLayout(buffer.format, buffer.width, buffer.height,
+                                       static_cast<uint32_t>(buffer.stride), layout);
+    writePublishChunks(buffer.buffer->buffer, layout);
+    writePublishHeader(*stream, buffer.buffer->buffer, getMonotonicMicros(), 0);
+    writePublishDamage(buffer.buffer->buffer, Damage(), buffer.width, buffer.height);
+    if(stream->cursorBuffers.acquire()){
+        stream->hasCursor = true;
+    }
+    writePublishCursor(*stream, buffer.buffer->buffer);
+    pw_stream_queue_buffer(stream->stream, buffer.buffer);
+    {
+        // The last submitted frame is older than this one; don't bring it back on a format change.
+        std::lock_guard<std::mutex> publishLock(stream->publishMutex);
+        stream->lastSource.clear();
+    }
 
-    pw_registry_add_listener(registry, &registryListener, &registryEvents, this);
+    buffer = PublishBuffer();
     return true;
+#else
+    (void)buffer;
+    return false;
+#endif
+}
+
+void ofxPipeWire::setPublishCursor(const CursorInfo& cursor){
+    setPublishCursor(getDefaultPublishStream(), cursor);
 }
 
-void ofxPipeWire::teardownPipeWire(){
-    if(registry){
-        pw_proxy_destroy(reinterpret_cast<pw_proxy*>(registry));
-        registry = nullptr;
+void ofxPipeWire::setPublishCursor(StreamHandle handle, const CursorInfo& cursor){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, true);
+    if(!initialized || !stream){
+        return;
+    }
+
+    // The serial belongs to setPublishCursorBitmap.
+    CursorInfo& latest = stream->cursorLatest.info;
+    const uint64_t bitmapSerial = latest.bitmapSerial;
+    latest = cursor;
+    latest.bitmapSerial = bitmapSerial;
+    publishCursor(*stream);
+#else
+    (void)handle;
+    (void)cursor;
+#endif
+}
+
+void ofxPipeWire::setPublishCursorBitmap(const ofPixels& bitmap){
+    setPublishCursorBitmap(getDefaultPublishStream(), bitmap);
+}
+
+void ofxPipeWire::setPublishCursorBitmap(StreamHandle handle, const ofPixels& bitmap){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, true);
+    if(!initialized || !stream){
+        return;
+    }
+
+    CursorSlot& latest = stream->cursorLatest;
+    latest.bitmapWidth = 0;
+    latest.bitmapHeight = 0;
+    if(bitmap.isAllocated()){
+        const spa_video_format format = toSpaFormat(bitmap.getPixelFormat());
+        ofxPipeWireConvert::PackedLayout packed;
+        ofxPipeWireConvert::RowConverter converter = ofxPipeWireConvert::getRowConverter(format, SPA_VIDEO_FORMAT_RGBA);
+        if(!ofxPipeWireConvert::getPackedLayout(format, packed) || !converter.isValid()){
+            ofLogWarning("ofxPipeWire") << "setPublishCursorBitmap needs RGBA, BGRA, RGB, BGR or GRAY pixels";
+            return;
+        }
+        const int width = static_cast<int>(bitmap.getWidth());
+        const int height = static_cast<int>(bitmap.getHeight());
+        latest.bitmap.resize(static_cast<size_t>(width) * height * 4);
+        converter.convertRows(bitmap.getData(), width * packed.bytesPerPixel, latest.bitmap.data(), width * 4, width, height);
+        latest.bitmapWidth = width;
+        latest.bitmapHeight = height;
+    }
+    ++latest.info.bitmapSerial;
+    publishCursor(*stream);
+#else
+    (void)handle;
+    (void)bitmap;
+#endif
+}
+
+bool ofxPipeWire::getLatestFrame(ofPixels& outPixels){
+    return getLatestFrame(getDefaultCaptureStream(), outPixels);
+}
+
+bool ofxPipeWire::getLatestFrame(StreamHandle handle, ofPixels& outPixels){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(initialized && stream && captureMode == CaptureMode::Lazy){
+        // Convert straight into the caller's pixels, and only for a frame it has not seen.
+        if(stream->captureBuffers.acquire()){
+            stream->hasLatestFrame = true;
+            const CaptureSlot& fresh = stream->captureSlots[stream->captureBuffers.readIndex()];
+            stream->stats.addLatency(getMonotonicMicros() - fresh.arrivalMicros);
+        }
+        const CaptureSlot& slot = stream->captureSlots[stream->captureBuffers.readIndex()];
+        if(!stream->hasLatestFrame || slot.sequence <= stream->captureDeliveredSequence){
+            return false;
+        }
+
+        uint64_t start = getMonotonicMicros();
+        allocateCapturePixels(outPixels, slot.info);
+        convertFromFormat(ofxPipeWireConvert::makePlanes(slot.raw.data(), slot.info.layout), outPixels, slot.info);
+        stream->stats.addConvertTime(getMonotonicMicros() - start);
+        stream->captureDeliveredSequence = slot.sequence;
+        return true;
+    }
+#endif
+
+    const ofPixels* frame = getLatestFrameView(handle);
+    if(!frame){
+        return false;
+    }
+
+    outPixels = *frame;
+    return true;
+}
+
+const ofPixels* ofxPipeWire::getLatestFrameView(){
+    return getLatestFrameView(getDefaultCaptureStream());
+}
+
+const ofPixels* ofxPipeWire::getLatestFrameView(StreamHandle handle){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!initialized || !stream){
+        return nullptr;
+    }
+
+    if(stream->captureBuffers.acquire()){
+        stream->hasLatestFrame = true;
+        const CaptureSlot& fresh = stream->captureSlots[stream->captureBuffers.readIndex()];
+        stream->stats.addLatency(getMonotonicMicros() - fresh.arrivalMicros);
+    }
+    if(!stream->hasLatestFrame){
+        return nullptr;
+    }
+
+    CaptureSlot& slot = stream->captureSlots[stream->captureBuffers.readIndex()];
+    if(captureMode == CaptureMode::Lazy && slot.pixelsSequence != slot.sequence){
+        uint64_t start = getMonotonicMicros();
+        allocateCapturePixels(slot.pixels, slot.info);
+        convertFromFormat(ofxPipeWireConvert::makePlanes(slot.raw.data(), slot.info.layout), slot.pixels, slot.info);
+        stream->stats.addConvertTime(getMonotonicMicros() - start);
+        slot.pixelsSequence = slot.sequence;
+    }
+    return &slot.pixels;
+#else
+    (void)handle;
+    return nullptr;
+#endif
+}
+
+ofxPipeWire::FrameTiming ofxPipeWire::getLatestFrameTiming(){
+    return getLatestFrameTiming(getDefaultCaptureStream());
+}
+
+ofxPipeWire::FrameTiming ofxPipeWire::getLatestFrameTiming(StreamHandle handle){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(initialized && stream && stream->hasLatestFrame){
+        return stream->captureSlots[stream->captureBuffers.readIndex()].timing;
+    }
+#else
+    (void)handle;
+#endif
+    return FrameTiming();
+}
+
+ofxPipeWire::CursorInfo ofxPipeWire::getCursor(){
+    return getCursor(getDefaultCaptureStream());
+}
+
+ofxPipeWire::CursorInfo ofxPipeWire::getCursor(StreamHandle handle){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!initialized || !stream){
+        return CursorInfo();
+    }
+
+    if(stream->cursorBuffers.acquire()){
+        stream->hasCursor = true;
+    }
+    if(stream->hasCursor){
+        return stream->cursorSlots[stream->cursorBuffers.readIndex()].info;
+    }
+#else
+    (void)handle;
+#endif
+    return CursorInfo();
+}
+
+bool ofxPipeWire::getCursorBitmap(ofPixels& outPixels){
+    return getCursorBitmap(getDefaultCaptureStream(), outPixels);
+}
+
+bool ofxPipeWire::getCursorBitmap(StreamHandle handle, ofPixels& outPixels){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!initialized || !stream){
+        return false;
+    }
+
+    if(stream->cursorBuffers.acquire()){
+        stream->hasCursor = true;
+    }
+    const CursorSlot& slot = stream->cursorSlots[stream->cursorBuffers.readIndex()];
+    if(!stream->hasCursor || slot.bitmapWidth <= 0 || slot.bitmapHeight <= 0){
+        return false;
+    }
+
+    if(outPixels.getWidth() != static_cast<size_t>(slot.bitmapWidth) ||
+       outPixels.getHeight() != static_cast<size_t>(slot.bitmapHeight) ||
+       outPixels.getPixelFormat() != OF_PIXELS_RGBA){
+        outPixels.allocate(slot.bitmapWidth, slot.bitmapHeight, OF_PIXELS_RGBA);
+    }
+    memcpy(outPixels.getData(), slot.bitmap.data(), slot.bitmap.size());
+    return true;
+#else
+    (void)handle;
+    (void)outPixels;
+    return false;
+#endif
+}
+
+void ofxPipeWire::setCaptureQueue(int depth, QueuePolicy policy){
+#ifdef TARGET_LINUX
+    captureQueueDepth = std::max(depth, 0);
+    captureQueuePolicy = policy;
+#endif
+    setCaptureQueue(getDefaultCaptureStream(), depth, policy);
+}
+
+void ofxPipeWire::setCaptureQueue(StreamHandle handle, int depth, QueuePolicy policy){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!stream){
+        return;
+    }
+    if(depth > 0 && captureMode == CaptureMode::Hold){
+        ofLogWarning("ofxPipeWire") << "The capture queue is not available with CaptureMode::Hold";
+        return;
+    }
+
+    LoopLock lock(threadLoop);
+    CaptureQueue& queue = stream->captureQueue;
+    queue.policy = policy;
+    const size_t frames = static_cast<size_t>(std::max(depth, 0));
+    if(queue.frames.size() == frames){
+        return;
+    }
+
+    // A new depth starts empty; its frames are allocated now rather than in process.
+    queue.frames.clear();
+    queue.frames.resize(frames);
+    queue.head = 0;
+    queue.count = 0;
+    stream->stats.queuedFrames.store(0, std::memory_order_relaxed);
+    allocateCaptureQueue(*stream);
+#else
+    (void)handle;
+    (void)depth;
+    (void)policy;
+#endif
+}
+
+bool ofxPipeWire::popCapturedFrame(ofPixels& outPixels, int timeoutMillis){
+    return popCapturedFrame(getDefaultCaptureStream(), outPixels, timeoutMillis);
+}
+
+bool ofxPipeWire::popCapturedFrame(StreamHandle handle, ofPixels& outPixels, int timeoutMillis){
+    FrameTiming timing;
+    return popCapturedFrame(handle, outPixels, timing, timeoutMillis);
+}
+
+bool ofxPipeWire::popCapturedFrame(StreamHandle handle, ofPixels& outPixels, FrameTiming& outTiming, int timeoutMillis){
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!initialized || !stream){
+        return false;
+    }
+
+    CaptureQueue& queue = stream->captureQueue;
+    {
+        LoopLock lock(threadLoop);
+        if(!queue.isEnabled()){
+            return false;
+        }
+
+        // The loop thread signals after every push; the main loop is pumped right here instead.
+        if(queue.count == 0 && timeoutMillis > 0){
+            if(threadLoop){
+                timespec deadline;
+                pw_thread_loop_get_time(threadLoop, &deadline, static_cast<int64_t>(timeoutMillis) * 1000000);
+                while(queue.count == 0 && pw_thread_loop_timed_wait_full(threadLoop, &deadline) == 0){
+                }
+            }else{
+                const uint64_t deadline = getMonotonicMicros() + static_cast<uint64_t>(timeoutMillis) * 1000;
+                pw_loop_enter(loop);
+                for(uint64_t now = getMonotonicMicros(); queue.count == 0 && now < deadline; now = getMonotonicMicros()){
+                    pw_loop_iterate(loop, static_cast<int>((deadline - now + 999) / 1000));
+                }
+                pw_loop_leave(loop);
+            }
+        }
+        if(queue.count == 0){
+            return false;
+        }
+
+        // The frame read last time goes back into the ring; its pixels no longer match any damage.
+        std::swap(queue.reading, queue.frames[queue.head]);
+        queue.frames[queue.head].pendingDamage.setFull();
+        queue.head = (queue.head + 1) % queue.frames.size();
+        --queue.count;
+        stream->stats.queuedFrames.store(queue.count, std::memory_order_relaxed);
+        if(queue.policy == QueuePolicy::Block){
+            drainCaptureQueue(*stream);
+        }
+    }
+
+    // reading belongs to this thread until the next pop.
+    const CaptureSlot& slot = queue.reading;
+    stream->stats.addLatency(getMonotonicMicros() - slot.arrivalMicros);
+    if(captureMode == CaptureMode::Lazy){
+        uint64_t start = getMonotonicMicros();
+        allocateCapturePixels(outPixels, slot.info);
+        convertFromFormat(ofxPipeWireConvert::makePlanes(slot.raw.data(), slot.info.layout), outPixels, slot.info);
+        stream->stats.addConvertTime(getMonotonicMicros() - start);
+    }else{
+        outPixels = slot.pixels;
+    }
+    outTiming = slot.timing;
+    return true;
+#else
+    (void)handle;
+    (void)outPixels;
+    (void)outTiming;
+    (void)timeoutMillis;
+    return false;
+#endif
+}
+
+ofxPipeWire::CapturedFrameView ofxPipeWire::acquireCapturedFrame(){
+    return acquireCapturedFrame(getDefaultCaptureStream());
+}
+
+ofxPipeWire::CapturedFrameView ofxPipeWire::acquireCapturedFrame(StreamHandle handle){
+    CapturedFrameView view;
+#ifdef TARGET_LINUX
+    VideoStream* stream = findStream(handle, false);
+    if(!initialized || !stream || captureMode != CaptureMode::Hold){
+        return view;
+    }
+
+    // Under the lock so remove_buffer cannot free the state while it is read.
+    LoopLock lock(threadLoop);
+    pw_buffer* buffer = stream->heldCaptureBuffer.exchange(nullptr, std::memory_order_acq_rel);
+    if(!buffer){
+        return view;
+    }
+
+    const BufferState* state = static_cast<const BufferState*>(buffer->user_data);
+    stream->stats.addLatency(getMonotonicMicros() - state->arrivalMicros);
+    view.owner = liveness;
+    view.stream = handle;
+    view.connectGeneration = stream->connectGeneration;
+    view.bufferEpoch = stream->bufferEpoch;
+    view.buffer = buffer;
+    view.data = state->planes.data[0];
+    view.width = state->info.width;
+    view.height = state->info.height;
+    view.stride = state->planes.stride[0];
+    view.planeCount = state->info.layout.count;
+    for(int i = 0; i < view.planeCount; ++i){
+        view.planeData[i] = state->planes.data[i];
+        view.planeStride[i] = state->planes.stride[i];
+    }
+    view.sequence = state->sequence;
+    view.timing = state->timing;
+    view.format = state->info.format;
+#else
+    (void)handle;
+#endif
+    return view;
+}
+
+ofxPipeWire::CapturedFrameView::~CapturedFrameView(){
+    release();
+}
+
+ofxPipeWire::CapturedFrameView::CapturedFrameView(CapturedFrameView&& other) noexcept{
+    *this = std::move(other);
+}
+
+ofxPipeWire::CapturedFrameView& ofxPipeWire::CapturedFrameView::operator=(CapturedFrameView&& other) noexcept{
+    if(this == &other){
+        return *this;
+    }
+
+    release();
+    data = other.data;
+    width = other.width;
+    height = other.height;
+    stride = other.stride;
+    planeCount = other.planeCount;
+    for(int i = 0; i < 3; ++i){
+        planeData[i] = other.planeData[i];
+        planeStride[i] = other.planeStride[i];
+    }
+    sequence = other.sequence;
+    timing = other.timing;
+    owner = std::move(other.owner);
+    stream = other.stream;
+    connectGeneration = other.connectGeneration;
+    bufferEpoch = other.bufferEpoch;
+#ifdef TARGET_LINUX
+    format = other.format;
+    buffer = other.buffer;
+    other.buffer = nullptr;
+#endif
+    other.data = nullptr;
+    other.owner.reset();
+    return *this;
+}
+
+void ofxPipeWire::CapturedFrameView::release(){
+#ifdef TARGET_LINUX
+    if(buffer){
+        if(std::shared_ptr<ofxPipeWire*> self = owner.lock()){
+            (*self)->releaseCapturedBuffer(stream, connectGeneration, bufferEpoch, buffer);
+        }
+    }
+    buffer = nullptr;
+#endif
+    owner.reset();
+    data = nullptr;
+}
+
+size_t ofxPipeWire::writeAudio(const ofSoundBuffer& buffer){
+#ifdef TARGET_LINUX
+    if(!initialized || !audioPublishEnabled){
+        return 0;
+    }
+
+    const uint32_t channels = std::min<uint32_t>(static_cast<uint32_t>(buffer.getNumChannels()), maxAudioChannels);
+    if(channels == 0){
+        return 0;
+    }
+    const float* planes[maxAudioChannels];
+    for(uint32_t c = 0; c < channels; ++c){
+        planes[c] = buffer.getBuffer().data() + c;
+    }
+    return pushAudio(audioPublishRing, planes, static_cast<uint32_t>(buffer.getNumChannels()), channels,
+                     buffer.getNumFrames(), audioWriteScratch);
+#else
+    (void)buffer;
+    return 0;
+#endif
+}
+
+size_t ofxPipeWire::writeAudio(const float* interleaved, size_t frames){
+#ifdef TARGET_LINUX
+    if(!initialized || !audioPublishEnabled || !interleaved){
+        return 0;
+    }
+    return audioPublishRing.write(interleaved, frames);
+#else
+    (void)interleaved;
+    (void)frames;
+    return 0;
+#endif
+}
+
+size_t ofxPipeWire::readAudio(ofSoundBuffer& buffer){
+#ifdef TARGET_LINUX
+    if(!initialized || !audioCaptureEnabled){
+        buffer.set(0.0f);
+        return 0;
+    }
+
+    const uint32_t bufferChannels = static_cast<uint32_t>(buffer.getNumChannels());
+    const uint32_t channels = std::min<uint32_t>(bufferChannels, maxAudioChannels);
+    if(channels < bufferChannels || channels == 0){
+        // Channels past maxAudioChannels are never written by popAudio.
+        buffer.set(0.0f);
+    }
+    if(channels == 0){
+        return 0;
+    }
+    float* planes[maxAudioChannels];
+    for(uint32_t c = 0; c < channels; ++c){
+        planes[c] = buffer.getBuffer().data() + c;
+    }
+    return popAudio(audioCaptureRing, planes, static_cast<uint32_t>(buffer.getNumChannels()), channels,
+                    buffer.getNumFrames(), audioReadScratch);
+#else
+    buffer.set(0.0f);
+    return 0;
+#endif
+}
+
+size_t ofxPipeWire::readAudio(float* interleaved, size_t frames){
+#ifdef TARGET_LINUX
+    if(!interleaved){
+        return 0;
+    }
+
+    size_t read = 0;
+    if(initialized && audioCaptureEnabled){
+        read = audioCaptureRing.read(interleaved, frames);
+    }
+    const size_t channels = static_cast<size_t>(std::max(audioConfig.channels, 1));
+    std::fill(interleaved + read * channels, interleaved + frames * channels, 0.0f);
+    return read;
+#else
+    (void)interleaved;
+    (void)frames;
+    return 0;
+#endif
+}
+
+size_t ofxPipeWire::getAudioReadAvailable() const{
+#ifdef TARGET_LINUX
+    return audioCaptureRing.getReadAvailable();
+#else
+    return 0;
+#endif
+}
+
+#ifdef TARGET_LINUX
+
+void ofxPipeWire::AudioRing::reset(size_t frames, int channelCount){
+    capacity = 1;
+    while(capacity < frames){
+        capacity <<= 1;
+    }
+    channels = std::max(channelCount, 1);
+    samples.assign(capacity * channels, 0.0f);
+    writePos.store(0, std::memory_order_relaxed);
+    readPos.store(0, std::memory_order_relaxed);
+}
+
+size_t ofxPipeWire::AudioRing::write(const float* src, size_t frames){
+    const size_t write = writePos.load(std::memory_order_relaxed);
+    const size_t read = readPos.load(std::memory_order_acquire);
+    frames = std::min(frames, capacity - (write - read));
+    if(frames == 0){
+        return 0;
+    }
+
+    // Positions only grow; the slot is the position modulo the power-of-two capacity.
+    const size_t start = write & (capacity - 1);
+    const size_t first = std::min(frames, capacity - start);
+    memcpy(samples.data() + start * channels, src, first * channels * sizeof(float));
+    memcpy(samples.data(), src + first * channels, (frames - first) * channels * sizeof(float));
+    writePos.store(write + frames, std::memory_order_release);
+    return frames;
+}
+
+size_t ofxPipeWire::AudioRing::read(float* dst, size_t frames){
+    const size_t read = readPos.load(std::memory_order_relaxed);
+    const size_t write = writePos.load(std::memory_order_acquire);
+    frames = std::min(frames, write - read);
+    if(frames == 0){
+        return 0;
+    }
+
+    const size_t start = read & (capacity - 1);
+    const size_t first = std::min(frames, capacity - start);
+    memcpy(dst, samples.data() + start * channels, first * channels * sizeof(float));
+    memcpy(dst + first * channels, samples.data(), (frames - first) * channels * sizeof(float));
+    readPos.store(read + frames, std::memory_order_release);
+    return frames;
+}
+
+size_t ofxPipeWire::AudioRing::getReadAvailable() const{
+    return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_relaxed);
+}
+
+std::mutex ofxPipeWire::connectionMutex;
+ofxPipeWire::Connection* ofxPipeWire::sharedConnections[2] = {nullptr, nullptr};
+
+ofxPipeWire::Connection* ofxPipeWire::acquireConnection(LoopMode mode){
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    Connection*& shared = sharedConnections[mode == LoopMode::ThreadLoop ? 1 : 0];
+    if(!shared){
+        std::unique_ptr<Connection> created(new Connection());
+        created->loopMode = mode;
+        if(!openConnection(*created)){
+            closeConnection(*created);
+            return nullptr;
+        }
+        shared = created.release();
+    }
+    ++shared->refCount;
+    return shared;
+}
+
+void ofxPipeWire::releaseConnection(Connection* released){
+    if(!released){
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    if(--released->refCount > 0){
+        return;
+    }
+    for(auto& shared : sharedConnections){
+        if(shared == released){
+            shared = nullptr;
+        }
+    }
+    closeConnection(*released);
+    delete released;
+}
+
+bool ofxPipeWire::openConnection(Connection& connection){
+    pw_init(nullptr, nullptr);
+
+    if(connection.loopMode == LoopMode::ThreadLoop){
+        connection.threadLoop = pw_thread_loop_new("ofxPipeWire", nullptr);
+        if(!connection.threadLoop){
+            ofLogError("ofxPipeWire") << "Failed to create PipeWire thread loop";
+            return false;
+        }
+        connection.loop = pw_thread_loop_get_loop(connection.threadLoop);
+    }else{
+        connection.mainLoop = pw_main_loop_new(nullptr);
+        if(!connection.mainLoop){
+            ofLogError("ofxPipeWire") << "Failed to create PipeWire main loop";
+            return false;
+        }
+        connection.loop = pw_main_loop_get_loop(connection.mainLoop);
+    }
+
+    connection.context = pw_context_new(connection.loop, nullptr, 0);
+    if(!connection.context){
+        ofLogError("ofxPipeWire") << "Failed to create PipeWire context";
+        return false;
+    }
+
+    if(connection.threadLoop && pw_thread_loop_start(connection.threadLoop) < 0){
+        ofLogError("ofxPipeWire") << "Failed to start PipeWire thread loop";
+        return false;
+    }
+
+    // Registry events fire on the loop thread as soon as the core is connected.
+    LoopLock lock(connection.threadLoop);
+
+    connection.core = pw_context_connect(connection.context, nullptr, 0);
+    if(!connection.core){
+        ofLogError("ofxPipeWire") << "Failed to connect PipeWire core";
+        return false;
+    }
+
+    connection.registry = pw_core_get_registry(connection.core, PW_VERSION_REGISTRY, 0);
+    if(!connection.registry){
+        ofLogError("ofxPipeWire") << "Failed to get PipeWire registry";
+        return false;
+    }
+
+    static const pw_registry_events registryEvents = {
+        PW_VERSION_REGISTRY_EVENTS,
+        .global = ofxPipeWire::onRegistryGlobal,
+        .global_remove = ofxPipeWire::onRegistryGlobalRemove
+    };
+
+    connection.discoveryEvent = pw_loop_add_event(connection.loop, ofxPipeWire::onDiscoveryEvent, &connection);
+    pw_registry_add_listener(connection.registry, &connection.registryListener, &registryEvents, &connection);
+    return true;
+}
+
+void ofxPipeWire::closeConnection(Connection& connection){
+    // Stopping the thread first guarantees no callback runs while objects are destroyed.
+    if(connection.threadLoop){
+        pw_thread_loop_stop(connection.threadLoop);
+    }
+
+    if(connection.registry){
+        pw_proxy_destroy(reinterpret_cast<pw_proxy*>(connection.registry));
+        connection.registry = nullptr;
+    }
+
+    if(connection.core){
+        pw_core_disconnect(connection.core);
+        connection.core = nullptr;
+    }
+
+    if(connection.discoveryEvent){
+        pw_loop_destroy_source(connection.loop, connection.discoveryEvent);
+        connection.discoveryEvent = nullptr;
+    }
+
+    if(connection.context){
+        pw_context_destroy(connection.context);
+        connection.context = nullptr;
+    }
+
+    if(connection.threadLoop){
+        pw_thread_loop_destroy(connection.threadLoop);
+        connection.threadLoop = nullptr;
+    }
+
+    if(connection.mainLoop){
+        pw_main_loop_destroy(connection.mainLoop);
+        connection.mainLoop = nullptr;
+    }
+
+    connection.loop = nullptr;
+
+    pw_deinit();
+}
+
+bool ofxPipeWire::setupPipeWire(){
+    // Later instances reuse the running connection and its registry cache.
+    connection = acquireConnection(loopMode);
+    if(!connection){
+        return false;
+    }
+
+    mainLoop = connection->mainLoop;
+    threadLoop = connection->threadLoop;
+    loop = connection->loop;
+    core = connection->core;
+    return true;
+}
+
+void ofxPipeWire::teardownPipeWire(){
+    {
+        // The loop keeps running for other instances; the lock keeps our callbacks out.
+        LoopLock lock(threadLoop);
+        for(auto& stream : videoStreams){
+            destroyVideoStream(*stream);
+        }
+
+        if(audioPublishStream){
+            pw_stream_destroy(audioPublishStream);
+            audioPublishStream = nullptr;
+        }
+
+        if(audioCaptureStream){
+            pw_stream_destroy(audioCaptureStream);
+            audioCaptureStream = nullptr;
+        }
+    }
+    videoStreams.clear();
+    defaultPublishStream = invalidStream;
+    defaultCaptureStream = invalidStream;
+
+    mainLoop = nullptr;
+    threadLoop = nullptr;
+    loop = nullptr;
+    core = nullptr;
+    releaseConnection(connection);
+    connection = nullptr;
+}
+
+std::vector<spa_video_format> ofxPipeWire::getOfferedFormats(const VideoStream& stream) const{
+    static const spa_video_format fallbackFormats[] = {
+        SPA_VIDEO_FORMAT_RGBA,
+        SPA_VIDEO_FORMAT_BGRA,
+        SPA_VIDEO_FORMAT_RGBx,
+        SPA_VIDEO_FORMAT_BGRx,
+        SPA_VIDEO_FORMAT_RGB,
+        SPA_VIDEO_FORMAT_BGR,
+        SPA_VIDEO_FORMAT_NV12,
+        SPA_VIDEO_FORMAT_I420,
+        SPA_VIDEO_FORMAT_YUY2,
+        SPA_VIDEO_FORMAT_UYVY,
+        SPA_VIDEO_FORMAT_GRAY8
+    };
+
+    std::vector<spa_video_format> formats;
+    auto offer = [&formats](spa_video_format fmt){
+        if(fmt != SPA_VIDEO_FORMAT_UNKNOWN && std::find(formats.begin(), formats.end(), fmt) == formats.end()){
+            formats.push_back(fmt);
+        }
+    };
+
+    // Publishing the submitted layout as is avoids expanding it on every frame.
+    if(stream.isPublish){
+        spa_video_format native = toSpaFormat(stream.config.pixelFormat);
+        offer(native);
+        if(native == SPA_VIDEO_FORMAT_RGB || native == SPA_VIDEO_FORMAT_BGR){
+            offer(native == SPA_VIDEO_FORMAT_RGB ? SPA_VIDEO_FORMAT_BGR : SPA_VIDEO_FORMAT_RGB);
+        }
+    }
+    for(const auto& pref : preferredFormats){
+        offer(toSpaFormat(pref));
+    }
+    for(const auto& fallback : fallbackFormats){
+        offer(fallback);
+    }
+    return formats;
+}
+
+spa_pod* ofxPipeWire::buildVideoFormat(spa_pod_builder& builder, const VideoStream& stream){
+    std::vector<spa_video_format> formats = getOfferedFormats(stream);
+
+    spa_pod_frame objectFrame;
+    spa_pod_frame choiceFrame;
+    spa_pod_builder_push_object(&builder, &objectFrame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(&builder,
+        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+        0);
+
+    // The first value of an enum choice is its default, followed by every alternative.
+    spa_pod_builder_prop(&builder, SPA_FORMAT_VIDEO_format, 0);
+    spa_pod_builder_push_choice(&builder, &choiceFrame, SPA_CHOICE_Enum, 0);
+    spa_pod_builder_id(&builder, formats.front());
+    for(const auto& fmt : formats){
+        spa_pod_builder_id(&builder, fmt);
+    }
+    spa_pod_builder_pop(&builder, &choiceFrame);
+
+    spa_pod_builder_add(&builder,
+        SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+            SPA_RECTANGLE(stream.config.width, stream.config.height),
+            SPA_RECTANGLE(16, 16),
+            SPA_RECTANGLE(8192, 8192)),
+        SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+            SPA_FRACTION(stream.config.fps, std::max(stream.config.fpsDenominator, 1)),
+            SPA_FRACTION(1, 1),
+            SPA_FRACTION(240, 1)),
+        0);
+
+    return static_cast<spa_pod*>(spa_pod_builder_pop(&builder, &objectFrame));
+}
+
+spa_pod* ofxPipeWire::buildBuffers(spa_pod_builder& builder, const StreamTuning& tuning, bool holdBuffers,
+                                   uint32_t blocks, uint32_t size, uint32_t stride){
+    const bool tuned = tuning.minBuffers > 0 || tuning.maxBuffers > 0 || tuning.bufferSize > 0 || tuning.strideAlign > 0;
+    if(!tuned && !holdBuffers){
+        return nullptr;
+    }
+
+    // A held view pins one buffer; leave the producer enough to keep cycling.
+    int minBuffers = tuning.minBuffers > 0 ? tuning.minBuffers : (holdBuffers ? 4 : 1);
+    int maxBuffers = tuning.maxBuffers > 0 ? tuning.maxBuffers : (holdBuffers ? 16 : 32);
+    maxBuffers = std::max(maxBuffers, minBuffers);
+    int defaultBuffers = std::min(std::max(holdBuffers ? 6 : minBuffers, minBuffers), maxBuffers);
+    if(tuning.bufferSize > 0){
+        size = static_cast<uint32_t>(tuning.bufferSize);
+    }
+
+    spa_pod_frame objectFrame;
+    spa_pod_builder_push_object(&builder, &objectFrame, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
+    spa_pod_builder_add(&builder,
+        SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(defaultBuffers, minBuffers, maxBuffers),
+        0);
+    if(blocks > 0){
+        spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks), 0);
+    }
+    if(size > 0){
+        spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_size, SPA_POD_Int(size), 0);
+    }
+    if(stride > 0){
+        spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride), 0);
+    }
+    if(tuning.strideAlign > 0){
+        spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_align, SPA_POD_Int(tuning.strideAlign), 0);
+    }
+    return static_cast<spa_pod*>(spa_pod_builder_pop(&builder, &objectFrame));
+}
+
+void ofxPipeWire::applyStreamTuning(pw_properties* props, const StreamTuning& tuning, int defaultRate){
+    std::string latency;
+    std::string rate;
+    getTuningProperties(tuning, defaultRate, latency, rate);
+    if(!latency.empty()){
+        pw_properties_set(props, PW_KEY_NODE_LATENCY, latency.c_str());
+    }
+    if(!rate.empty()){
+        pw_properties_set(props, PW_KEY_NODE_RATE, rate.c_str());
+    }
+}
+
+void ofxPipeWire::getTuningProperties(const StreamTuning& tuning, int defaultRate, std::string& latency, std::string& rate){
+    latency.clear();
+    rate.clear();
+    if(tuning.latencyFrames > 0){
+        int latencyRate = tuning.latencyRate > 0 ? tuning.latencyRate : (tuning.rate > 0 ? tuning.rate : defaultRate);
+        latency = ofToString(tuning.latencyFrames) + "/" + ofToString(latencyRate);
+    }
+    if(tuning.rate > 0){
+        rate = "1/" + ofToString(tuning.rate);
+    }
+}
+
+uint32_t ofxPipeWire::buildMetaParams(spa_pod_builder& builder, bool isPublish, const spa_pod** params){
+    uint32_t count = 0;
+    params[count++] = static_cast<const spa_pod*>(spa_pod_builder_add_object(&builder,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+        SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_header))));
+    params[count++] = static_cast<const spa_pod*>(spa_pod_builder_add_object(&builder,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+        SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+            static_cast<int>(sizeof(spa_meta_region) * Damage::maxRects),
+            static_cast<int>(sizeof(spa_meta_region)),
+            static_cast<int>(sizeof(spa_meta_region) * Damage::maxRects))));
+    auto cursorMetaSize = [](int size){
+        return static_cast<int>(sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap)) + size * size * 4;
+    };
+    params[count++] = static_cast<const spa_pod*>(spa_pod_builder_add_object(&builder,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+        SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(cursorMetaSize(64), cursorMetaSize(1), cursorMetaSize(256))));
+    // Published frames are never cropped.
+    if(!isPublish){
+        params[count++] = static_cast<const spa_pod*>(spa_pod_builder_add_object(&builder,
+            SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+            SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+            SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_region))));
+    }
+    return count;
+}
+
+uint32_t ofxPipeWire::alignStride(uint32_t stride, int align){
+    if(align <= 1){
+        return stride;
+    }
+    const uint32_t step = static_cast<uint32_t>(align);
+    return (stride + step - 1) / step * step;
+}
+
+spa_pod* ofxPipeWire::buildAudioFormat(spa_pod_builder& builder){
+    spa_audio_format preferred = audioConfig.planar ? SPA_AUDIO_FORMAT_F32P : SPA_AUDIO_FORMAT_F32;
+    spa_audio_format alternative = audioConfig.planar ? SPA_AUDIO_FORMAT_F32 : SPA_AUDIO_FORMAT_F32P;
+
+    return reinterpret_cast<spa_pod*>(
+        spa_pod_builder_add_object(&builder,
+            SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+            SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_audio),
+            SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+            SPA_FORMAT_AUDIO_format, SPA_POD_CHOICE_ENUM_Id(3, preferred, preferred, alternative),
+            SPA_FORMAT_AUDIO_rate, SPA_POD_Int(audioConfig.sampleRate),
+            SPA_FORMAT_AUDIO_channels, SPA_POD_Int(audioConfig.channels)
+        )
+    );
+}
+
+ofxPipeWire::NegotiatedVideo ofxPipeWire::getDefaultVideoInfo(const VideoStream& stream) const{
+    const VideoConfig& config = stream.config;
+    NegotiatedVideo info;
+    info.width = config.width;
+    info.height = config.height;
+    info.fps = config.fps;
+    info.format = getOfferedFormats(stream).front();
+    ofxPipeWireConvert::getPlaneLayout(info.format, info.width, info.height, 0, info.layout);
+    if(stream.isPublish && config.tuning.strideAlign > 1){
+        ofxPipeWireConvert::getPlaneLayout(info.format, info.width, info.height,
+                                           alignStride(info.layout.stride[0], config.tuning.strideAlign), info.layout);
+    }
+    info.stride = info.layout.stride[0];
+    info.valid = true;
+    return info;
+}
+
+bool ofxPipeWire::mapBufferPlanes(spa_buffer* buffer, const NegotiatedVideo& info, bool useChunks,
+                                  ofxPipeWireConvert::Planes& planes){
+    const ofxPipeWireConvert::PlaneLayout& layout = info.layout;
+    if(!buffer || buffer->n_datas == 0 || layout.count == 0){
+        return false;
+    }
+
+    // Producers either hand out one spa_data per plane or put all planes in the first one.
+    if(buffer->n_datas >= static_cast<uint32_t>(layout.count)){
+        for(int i = 0; i < layout.count; ++i){
+            spa_data& data = buffer->datas[i];
+            if(!data.data || !data.chunk){
+                return false;
+            }
+            uint32_t offset = useChunks ? data.chunk->offset : 0;
+            uint32_t stride = useChunks && data.chunk->stride > 0 ? static_cast<uint32_t>(data.chunk->stride) : layout.stride[i];
+            if(offset + static_cast<size_t>(stride) * layout.height[i] > data.maxsize){
+                return false;
+            }
+            planes.data[i] = static_cast<uint8_t*>(data.data) + offset;
+            planes.stride[i] = static_cast<int>(stride);
+        }
+        return true;
+    }
+
+    spa_data& data = buffer->datas[0];
+    if(!data.data || !data.chunk){
+        return false;
+    }
+    uint32_t offset = useChunks ? data.chunk->offset : 0;
+    ofxPipeWireConvert::PlaneLayout packed = layout;
+    if(useChunks && data.chunk->stride > 0 && static_cast<uint32_t>(data.chunk->stride) != layout.stride[0]){
+        ofxPipeWireConvert::getPlaneLayout(info.format, info.width, info.height,
+                                           static_cast<uint32_t>(data.chunk->stride), packed);
+    }
+    if(offset + packed.size > data.maxsize){
+        return false;
+    }
+    planes = ofxPipeWireConvert::makePlanes(static_cast<uint8_t*>(data.data) + offset, packed);
+    return true;
+}
+
+void ofxPipeWire::writePublishChunks(spa_buffer* buffer, const ofxPipeWireConvert::PlaneLayout& layout){
+    if(buffer->n_datas >= static_cast<uint32_t>(layout.count)){
+        for(int i = 0; i < layout.count; ++i){
+            spa_chunk* chunk = buffer->datas[i].chunk;
+            chunk->offset = 0;
+            chunk->size = layout.stride[i] * layout.height[i];
+            chunk->stride = static_cast<int32_t>(layout.stride[i]);
+        }
+        return;
+    }
+
+    spa_chunk* chunk = buffer->datas[0].chunk;
+    chunk->offset = 0;
+    chunk->size = static_cast<uint32_t>(layout.size);
+    chunk->stride = static_cast<int32_t>(layout.stride[0]);
+}
+
+ofxPipeWire::StreamHandle ofxPipeWire::addVideoStream(bool isPublish, const std::string& target, const VideoConfig& config){
+    std::unique_ptr<VideoStream> stream(new VideoStream());
+    stream->handle = nextStreamHandle++;
+    stream->isPublish = isPublish;
+    stream->config = config;
+    stream->targetObject = target;
+    // The streams setup() creates keep the plain node name; later ones are numbered.
+    stream->name = initialized ? nodeName + " " + ofToString(stream->handle) : nodeName;
+    if(!isPublish && !initialized){
+        stream->captureRegion = captureRegion;
+        if(captureMode != CaptureMode::Hold){
+            stream->captureQueue.frames.resize(static_cast<size_t>(captureQueueDepth));
+            stream->captureQueue.policy = captureQueuePolicy;
+        }
+    }
+
+    stream->info = getDefaultVideoInfo(*stream);
+    if(isPublish){
+        stream->info.converter = ofxPipeWireConvert::getFrameConverter(toSpaFormat(config.pixelFormat), stream->info.format,
+                                                                       stream->info.matrix, stream->info.range);
+    }else{
+        stream->info.converter = ofxPipeWireConvert::getFrameConverter(stream->info.format, toSpaFormat(captureOutputFormat),
+                                                                       stream->info.matrix, stream->info.range);
+    }
+    stream->publishBuffers.reset();
+    stream->captureBuffers.reset();
+    stream->cursorBuffers.reset();
+
+    bool connected = false;
+    {
+        LoopLock lock(threadLoop);
+        connected = createVideoStream(*stream);
+        if(!connected){
+            destroyVideoStream(*stream);
+        }
+    }
+    if(!connected){
+        return invalidStream;
+    }
+
+    StreamHandle handle = stream->handle;
+    videoStreams.push_back(std::move(stream));
+    return handle;
+}
+
+bool ofxPipeWire::createVideoStream(VideoStream& stream){
+    const bool isPublish = stream.isPublish;
+    // From the graph's point of view our publish stream is a video source and the capture stream a sink.
+    pw_properties* props = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Video",
+        PW_KEY_MEDIA_CATEGORY, isPublish ? "Capture" : "Playback",
+        PW_KEY_MEDIA_ROLE, "Screen",
+        PW_KEY_APP_NAME, appName.c_str(),
+        PW_KEY_NODE_NAME, stream.name.c_str(),
+        nullptr
+    );
+
+    if(!stream.targetObject.empty()){
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, stream.targetObject.c_str());
+    }
+    applyStreamTuning(props, stream.config.tuning, 48000);
+
+    stream.stream = pw_stream_new(core, isPublish ? "ofxPipeWire Publish" : "ofxPipeWire Capture", props);
+    if(!stream.stream){
+        ofLogError("ofxPipeWire") << "Failed to create " << (isPublish ? "publish" : "capture") << " stream";
+        return false;
+    }
+
+    stream.listenerData.self = this;
+    stream.listenerData.isPublish = isPublish;
+    stream.listenerData.video = &stream;
+
+    static const pw_stream_events publishEvents = {
+        PW_VERSION_STREAM_EVENTS,
+        .state_changed = ofxPipeWire::onStreamStateChanged,
+        .param_changed = ofxPipeWire::onStreamParamChanged,
+        .add_buffer = ofxPipeWire::onStreamAddBuffer,
+        .remove_buffer = ofxPipeWire::onStreamRemoveBuffer,
+        .process = ofxPipeWire::onPublishProcess
+    };
+    static const pw_stream_events captureEvents = {
+        PW_VERSION_STREAM_EVENTS,
+        .state_changed = ofxPipeWire::onStreamStateChanged,
+        .param_changed = ofxPipeWire::onStreamParamChanged,
+        .add_buffer = ofxPipeWire::onStreamAddBuffer,
+        .remove_buffer = ofxPipeWire::onStreamRemoveBuffer,
+        .process = ofxPipeWire::onCaptureProcess
+    };
+
+    pw_stream_add_listener(stream.stream, &stream.listener, isPublish ? &publishEvents : &captureEvents,
+                           &stream.listenerData);
+
+    if(isPublish && stream.config.driver){
+        stream.driverTimer = pw_loop_add_timer(loop, ofxPipeWire::onDriverTimer, &stream.listenerData);
+        if(!stream.driverTimer){
+            ofLogWarning("ofxPipeWire") << "Failed to create the driver timer; the stream follows the graph";
+        }else if(!threadLoop){
+            ofLogNotice("ofxPipeWire") << "Driver ticks only run while update() pumps the main loop";
+        }
+    }
+
+    return connectVideoStream(stream);
+}
+
+bool ofxPipeWire::connectVideoStream(VideoStream& stream){
+    const bool isPublish = stream.isPublish;
+    uint8_t buffer[2048];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod* params[8];
+    uint32_t paramCount = 0;
+    params[paramCount++] = buildVideoFormat(builder, stream);
+    paramCount += buildMetaParams(builder, isPublish, params + paramCount);
+    spa_pod* buffers = nullptr;
+    if(isPublish){
+        NegotiatedVideo defaults = getDefaultVideoInfo(stream);
+        buffers = buildBuffers(builder, stream.config.tuning, false, 1,
+                               static_cast<uint32_t>(defaults.layout.size), defaults.layout.stride[0]);
+    }else{
+        buffers = buildBuffers(builder, stream.config.tuning, captureMode == CaptureMode::Hold, 0, 0, 0);
+    }
+    if(buffers){
+        params[paramCount++] = buffers;
+    }
+
+    uint32_t flags = PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS;
+    if(stream.driverTimer){
+        flags |= PW_STREAM_FLAG_DRIVER;
+    }
+
+    int res = pw_stream_connect(
+        stream.stream,
+        isPublish ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT,
+        PW_ID_ANY,
+        static_cast<pw_stream_flags>(flags),
+        params,
+        paramCount
+    );
+
+    if(res < 0){
+        ofLogError("ofxPipeWire") << "Failed to connect " << (isPublish ? "publish" : "capture") << " stream";
+        return false;
+    }
+
+    return true;
+}
+
+bool ofxPipeWire::retargetVideoStream(VideoStream& stream, const std::string& target){
+    LoopLock lock(threadLoop);
+    if(!stream.stream){
+        return false;
+    }
+
+    // Only this stream's link is rebuilt; its slots keep the last frame until the new source delivers.
+    pw_stream_disconnect(stream.stream);
+    stream.heldCaptureBuffer = nullptr;
+    ++stream.connectGeneration;
+    stream.publishQueuedGeneration = BufferState::unwritten;
+    stream.hasHeaderSequence = false;
+    for(CaptureSlot& slot : stream.captureSlots){
+        slot.pendingDamage.setFull();
+    }
+    for(CaptureSlot& slot : stream.captureQueue.frames){
+        slot.pendingDamage.setFull();
+    }
+    if(!stream.isPublish){
+        // The new source may not send a pointer at all.
+        stream.cursorLatest.info.visible = false;
+        publishCursor(stream);
+    }
+    stream.targetObject = target;
+
+    // A null value removes the key, which lets the session manager pick a default again.
+    spa_dict_item items[1] = {
+        SPA_DICT_ITEM_INIT(PW_KEY_TARGET_OBJECT, target.empty() ? nullptr : target.c_str())
+    };
+    spa_dict dict = SPA_DICT_INIT(items, 1);
+    pw_stream_update_properties(stream.stream, &dict);
+
+    if(!connectVideoStream(stream)){
+        return false;
+    }
+    ofLogNotice("ofxPipeWire") << (stream.isPublish ? "Publish" : "Capture") << " stream retargeted to "
+                               << (target.empty() ? "default" : target);
+    return true;
+}
+
+bool ofxPipeWire::renegotiateVideoStream(VideoStream& stream, const VideoConfig& config){
+    LoopLock lock(threadLoop);
+    if(!stream.stream){
+        return false;
+    }
+
+    stream.config = config;
+
+    uint8_t buffer[1024];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod* params[2];
+    uint32_t paramCount = 0;
+    params[paramCount++] = buildVideoFormat(builder, stream);
+    if(stream.isPublish){
+        NegotiatedVideo defaults = getDefaultVideoInfo(stream);
+        if(spa_pod* buffers = buildBuffers(builder, config.tuning, false, 1,
+                                           static_cast<uint32_t>(defaults.layout.size), defaults.layout.stride[0])){
+            params[paramCount++] = buffers;
+        }
+    }
+
+    // The link stays up; PipeWire renegotiates against the new EnumFormat and
+    // param_changed reports the result.
+    if(pw_stream_update_params(stream.stream, params, paramCount) < 0){
+        ofLogError("ofxPipeWire") << "Failed to renegotiate " << (stream.isPublish ? "publish" : "capture") << " stream";
+        return false;
+    }
+    return true;
+}
+
+bool ofxPipeWire::isSameFormatRequest(const VideoConfig& a, const VideoConfig& b){
+    return a.width == b.width && a.height == b.height && a.fps == b.fps && a.fpsDenominator == b.fpsDenominator &&
+           a.pixelFormat == b.pixelFormat &&
+           a.tuning.minBuffers == b.tuning.minBuffers && a.tuning.maxBuffers == b.tuning.maxBuffers &&
+           a.tuning.bufferSize == b.tuning.bufferSize && a.tuning.strideAlign == b.tuning.strideAlign;
+}
+
+bool ofxPipeWire::isSameScheduling(const StreamTuning& a, const StreamTuning& b){
+    return a.latencyFrames == b.latencyFrames && a.latencyRate == b.latencyRate && a.rate == b.rate;
+}
+
+bool ofxPipeWire::updateStreamScheduling(VideoStream& stream, const StreamTuning& tuning){
+    std::string latency;
+    std::string rate;
+    getTuningProperties(tuning, 48000, latency, rate);
+
+    // A null value removes the key, handing the choice back to PipeWire.
+    spa_dict_item items[2] = {
+        SPA_DICT_ITEM_INIT(PW_KEY_NODE_LATENCY, latency.empty() ? nullptr : latency.c_str()),
+        SPA_DICT_ITEM_INIT(PW_KEY_NODE_RATE, rate.empty() ? nullptr : rate.c_str())
+    };
+    spa_dict dict = SPA_DICT_INIT(items, 2);
+
+    LoopLock lock(threadLoop);
+    if(!stream.stream || pw_stream_update_properties(stream.stream, &dict) < 0){
+        ofLogError("ofxPipeWire") << "Failed to update the latency and rate of " << (stream.isPublish ? "publish" : "capture")
+                                  << " stream";
+        return false;
+    }
+    stream.config.tuning.latencyFrames = tuning.latencyFrames;
+    stream.config.tuning.latencyRate = tuning.latencyRate;
+    stream.config.tuning.rate = tuning.rate;
+    return true;
+}
+
+void ofxPipeWire::convertIntoSlot(VideoStream& stream, const ofPixels& pixels, const Damage& damage){
+    const NegotiatedVideo& info = stream.info;
+
+    // Convert here, on the caller's thread, so the process callback only has to copy.
+    uint64_t start = getMonotonicMicros();
+    const uint64_t generation = ++stream.publishGeneration;
+    Damage& recorded = stream.publishDamage[generation % damageHistory];
+    recorded = damage;
+    if(!isSameLayout(stream.publishDamageInfo, info) ||
+       pixels.getWidth() != static_cast<size_t>(info.width) || pixels.getHeight() != static_cast<size_t>(info.height)){
+        recorded.setFull();
+    }
+    stream.publishDamageInfo = info;
+
+    // The write slot holds an older generation; patch it with everything that changed since.
+    PublishSlot& slot = stream.publishSlots[stream.publishBuffers.writeIndex()];
+    Damage pending;
+    if(slot.data.size() == info.layout.size){
+        pending = getDamageSince(stream.publishDamage, slot.generation, generation);
+    }else{
+        slot.data.resize(info.layout.size);
+    }
+    convertToFormat(pixels, ofxPipeWireConvert::makePlanes(slot.data.data(), info.layout), info, stream.publishScratch,
+                    &pending);
+    slot.info = info;
+    slot.generation = generation;
+    slot.damage = stream.publishDamage;
+    slot.submitMicros = getMonotonicMicros();
+    stream.stats.addConvertTime(slot.submitMicros - start);
+    if(stream.publishBuffers.publish()){
+        stream.stats.count(stream.stats.framesDropped);
+    }
+}
+
+void ofxPipeWire::destroyVideoStream(VideoStream& stream){
+    stream.heldCaptureBuffer = nullptr;
+    if(stream.driverTimer){
+        pw_loop_destroy_source(loop, stream.driverTimer);
+        stream.driverTimer = nullptr;
+    }
+    if(stream.stream){
+        pw_stream_destroy(stream.stream);
+        stream.stream = nullptr;
+    }
+}
+
+ofxPipeWire::VideoStream* ofxPipeWire::findStream(StreamHandle handle, bool isPublish) const{
+    VideoStream* stream = findStream(handle);
+    return stream && stream->isPublish == isPublish ? stream : nullptr;
+}
+
+ofxPipeWire::VideoStream* ofxPipeWire::findStream(StreamHandle handle) const{
+    for(const auto& stream : videoStreams){
+        if(stream->handle == handle){
+            return stream.get();
+        }
+    }
+    return nullptr;
+}
+
+bool ofxPipeWire::createAudioStream(bool isPublish){
+    const std::string audioNodeName = nodeName + (isPublish ? " Audio Playback" : " Audio Capture");
+    pw_properties* props = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Audio",
+        PW_KEY_MEDIA_CATEGORY, isPublish ? "Playback" : "Capture",
+        PW_KEY_MEDIA_ROLE, "Music",
+        PW_KEY_APP_NAME, appName.c_str(),
+        PW_KEY_NODE_NAME, audioNodeName.c_str(),
+        nullptr
+    );
+    applyStreamTuning(props, audioConfig.tuning, audioConfig.sampleRate);
+
+    pw_stream*& stream = isPublish ? audioPublishStream : audioCaptureStream;
+    stream = pw_stream_new(core, isPublish ? "ofxPipeWire Audio Publish" : "ofxPipeWire Audio Capture", props);
+    if(!stream){
+        ofLogError("ofxPipeWire") << "Failed to create audio " << (isPublish ? "publish" : "capture") << " stream";
+        return false;
+    }
+
+    StreamListenerData& listenerData = isPublish ? audioPublishListenerData : audioCaptureListenerData;
+    listenerData.self = this;
+    listenerData.isPublish = isPublish;
+    listenerData.isAudio = true;
+
+    static const pw_stream_events audioPublishEvents = {
+        PW_VERSION_STREAM_EVENTS,
+        .state_changed = ofxPipeWire::onStreamStateChanged,
+        .param_changed = ofxPipeWire::onStreamParamChanged,
+        .process = ofxPipeWire::onAudioPublishProcess
+    };
+    static const pw_stream_events audioCaptureEvents = {
+        PW_VERSION_STREAM_EVENTS,
+        .state_changed = ofxPipeWire::onStreamStateChanged,
+        .param_changed = ofxPipeWire::onStreamParamChanged,
+        .process = ofxPipeWire::onAudioCaptureProcess
+    };
+
+    pw_stream_add_listener(stream, isPublish ? &audioPublishListener : &audioCaptureListener,
+                           isPublish ? &audioPublishEvents : &audioCaptureEvents, &listenerData);
+
+    uint8_t buffer[1024];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod* params[2];
+    uint32_t paramCount = 0;
+    params[paramCount++] = buildAudioFormat(builder);
+    if(spa_pod* buffers = buildBuffers(builder, audioConfig.tuning, false, 0, 0, 0)){
+        params[paramCount++] = buffers;
+    }
+
+    // RT_PROCESS runs process on PipeWire's data thread, independent of update() and the loop mode.
+    int res = pw_stream_connect(
+        stream,
+        isPublish ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT,
+        PW_ID_ANY,
+        static_cast<pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS),
+        params,
+        paramCount
+    );
+
+    if(res < 0){
+        ofLogError("ofxPipeWire") << "Failed to connect audio " << (isPublish ? "publish" : "capture") << " stream";
+        return false;
+    }
+
+    return true;
+}
+
+void ofxPipeWire::onRegistryGlobal(void* data, uint32_t id, uint32_t permissions,
+                                  const char* type, uint32_t version, const spa_dict* props){
+    (void)permissions;
+    (void)version;
+    Connection* connection = static_cast<Connection*>(data);
+    if(!connection || !type){
+        return;
+    }
+
+    if(strcmp(type, PW_TYPE_INTERFACE_Node) == 0){
+        addNodeInfo(*connection, id, props);
+    }else if(strcmp(type, PW_TYPE_INTERFACE_Port) == 0){
+        addPortInfo(*connection, id, props);
+    }
+}
+
+void ofxPipeWire::onRegistryGlobalRemove(void* data, uint32_t id){
+    Connection* connection = static_cast<Connection*>(data);
+    if(!connection){
+        return;
+    }
+    removeObject(*connection, id);
+}
+
+void ofxPipeWire::onStreamStateChanged(void* data, enum pw_stream_state oldState,
+                                      enum pw_stream_state state, const char* error){
+    (void)oldState;
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    if(!self){
+        return;
+    }
+
+    if(state == PW_STREAM_STATE_ERROR){
+        ofLogError("ofxPipeWire") << "Stream error: " << (error ? error : "unknown");
+    }
+    if(state == PW_STREAM_STATE_STREAMING){
+        ofLogNotice("ofxPipeWire") << "Stream is streaming";
+        if(listenerData->video && listenerData->video->driverTimer){
+            self->scheduleDriverTick(*listenerData->video, true);
+        }
+    }
+}
+
+void ofxPipeWire::onDriverTimer(void* data, uint64_t expirations){
+    (void)expirations;
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    VideoStream* stream = listenerData ? listenerData->video : nullptr;
+    if(!self || !stream || !stream->stream){
+        return;
+    }
+
+    // Ticks stop with the stream and start again from the next STREAMING state.
+    if(pw_stream_get_state(stream->stream, nullptr) != PW_STREAM_STATE_STREAMING){
+        return;
+    }
+    // Another driver may have been picked for the graph; the stream then just follows it.
+    if(pw_stream_is_driving(stream->stream)){
+        pw_stream_trigger_process(stream->stream);
+    }
+    self->scheduleDriverTick(*stream, false);
+}
+
+void ofxPipeWire::scheduleDriverTick(VideoStream& stream, bool restart){
+    const uint64_t now = getMonotonicMicros() * 1000;
+    const uint64_t fps = static_cast<uint64_t>(std::max(stream.config.fps, 1));
+    const uint64_t denominator = static_cast<uint64_t>(std::max(stream.config.fpsDenominator, 1));
+    if(stream.driverFps != stream.config.fps || stream.driverFpsDenominator != stream.config.fpsDenominator){
+        restart = true;
+    }
+
+    // Tick n is due at start + n * denominator / fps seconds, split so the product cannot overflow.
+    auto tickTime = [&](uint64_t tick){
+        return stream.driverStartNanos + (tick / fps) * denominator * 1000000000ull +
+               (tick % fps) * denominator * 1000000000ull / fps;
+    };
+    uint64_t next = 0;
+    if(!restart){
+        next = tickTime(++stream.driverTicks);
+        // After a stall, start over from now instead of firing a burst of late ticks.
+        restart = next <= now;
+    }
+    if(restart){
+        stream.driverStartNanos = now;
+        stream.driverTicks = 1;
+        stream.driverFps = stream.config.fps;
+        stream.driverFpsDenominator = stream.config.fpsDenominator;
+        next = tickTime(1);
+    }
+
+    timespec value;
+    value.tv_sec = static_cast<time_t>(next / 1000000000ull);
+    value.tv_nsec = static_cast<long>(next % 1000000000ull);
+    pw_loop_update_timer(loop, stream.driverTimer, &value, nullptr, true);
+}
+
+void ofxPipeWire::onStreamParamChanged(void* data, uint32_t id, const spa_pod* param){
+    if(id != SPA_PARAM_Format || param == nullptr){
+        return;
+    }
+
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    if(!self){
+        return;
+    }
+
+    if(listenerData->isAudio){
+        spa_audio_info_raw info = {};
+        if(spa_format_audio_raw_parse(param, &info) < 0){
+            return;
+        }
+        self->onAudioFormatChanged(listenerData->isPublish, info);
+        return;
+    }
+
+    spa_video_info_raw info = {};
+    if(spa_format_video_raw_parse(param, &info) < 0){
+        return;
+    }
+
+    if(listenerData->video){
+        self->onVideoFormatChanged(*listenerData->video, info);
+    }
+}
+
+void ofxPipeWire::onStreamAddBuffer(void* data, pw_buffer* buffer){
+    (void)data;
+    buffer->user_data = new BufferState();
+}
+
+void ofxPipeWire::onStreamRemoveBuffer(void* data, pw_buffer* buffer){
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    if(self && listenerData->video){
+        ++listenerData->video->bufferEpoch;
+        if(!listenerData->isPublish){
+            pw_buffer* expected = buffer;
+            listenerData->video->heldCaptureBuffer.compare_exchange_strong(expected, nullptr);
+        }
+    }
+
+    delete static_cast<BufferState*>(buffer->user_data);
+    buffer->user_data = nullptr;
+}
+
+void ofxPipeWire::onPublishProcess(void* data){
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    VideoStream* stream = listenerData ? listenerData->video : nullptr;
+    if(!self || !stream || !stream->stream){
+        return;
+    }
+
+    // The app queues buffers itself through acquire/commitPublishBuffer.
+    if(stream->directPublish){
+        return;
+    }
+
+    // A frame converted for the previous format waits for its reconverted copy rather than going out black.
+    uint64_t generation = 0;
+    if(!acquirePublishGeneration(*stream, generation)){
+        return;
+    }
+    // A cursor change goes out on its own, as metadata over the unchanged frame.
+    if(stream->cursorBuffers.acquire()){
+        stream->hasCursor = true;
+        stream->cursorPending = true;
+    }
+    const bool unchanged = self->publishOnlyOnChange && generation == stream->publishQueuedGeneration;
+    if(unchanged && !stream->cursorPending){
+        return;
+    }
+
+    pw_buffer* buffer = pw_stream_dequeue_buffer(stream->stream);
+    if(!buffer){
+        stream->stats.count(stream->stats.bufferUnderruns);
+        return;
+    }
+
+    // Only the pointer moved: empty chunks tell the consumer there are no new pixels.
+    if(unchanged){
+        spa_buffer* spaBuffer = buffer->buffer;
+        for(uint32_t i = 0; i < spaBuffer->n_datas; ++i){
+            if(spa_chunk* chunk = spaBuffer->datas[i].chunk){
+                chunk->offset = 0;
+                chunk->size = 0;
+            }
+        }
+        Damage none;
+        none.clear();
+        writePublishHeader(*stream, spaBuffer, getMonotonicMicros(), 0);
+        writePublishDamage(spaBuffer, none, stream->info.width, stream->info.height);
+        writePublishCursor(*stream, spaBuffer);
+        stream->cursorPending = false;
+        pw_stream_queue_buffer(stream->stream, buffer);
+        return;
+    }
+
+    fillPublishBuffer(*stream, buffer, generation);
+    // Black filler goes out flagged as a gap; a repeated frame keeps its original submit time.
+    if(generation != 0){
+        const PublishSlot& slot = stream->publishSlots[stream->publishBuffers.readIndex()];
+        writePublishHeader(*stream, buffer->buffer, slot.submitMicros, 0);
+        writePublishDamage(buffer->buffer, getDamageSince(slot.damage, stream->publishQueuedGeneration, generation),
+                           stream->info.width, stream->info.height);
+    }else{
+        writePublishHeader(*stream, buffer->buffer, getMonotonicMicros(), SPA_META_HEADER_FLAG_GAP);
+        writePublishDamage(buffer->buffer, Damage(), stream->info.width, stream->info.height);
+    }
+    writePublishCursor(*stream, buffer->buffer);
+    stream->cursorPending = false;
+    pw_stream_queue_buffer(stream->stream, buffer);
+    stream->stats.count(stream->stats.framesProcessed);
+    if(generation != 0 && generation != stream->publishQueuedGeneration){
+        const PublishSlot& slot = stream->publishSlots[stream->publishBuffers.readIndex()];
+        stream->stats.addLatency(getMonotonicMicros() - slot.submitMicros);
+    }
+    stream->publishQueuedGeneration = generation;
+}
+
+void ofxPipeWire::onCaptureProcess(void* data){
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    VideoStream* stream = listenerData ? listenerData->video : nullptr;
+    if(!self || !stream || !stream->stream){
+        return;
+    }
+
+    // Every dequeued header is read, so missedFrames only reports gaps upstream of this stream.
+    const uint64_t arrivalMicros = getMonotonicMicros();
+    if(self->captureMode == CaptureMode::Hold){
+        // Keep only the newest buffer; anything older goes straight back.
+        pw_buffer* newest = nullptr;
+        FrameTiming newestTiming;
+        bool dequeued = false;
+        while(pw_buffer* buffer = pw_stream_dequeue_buffer(stream->stream)){
+            dequeued = true;
+            stream->stats.count(stream->stats.framesProcessed);
+            FrameTiming timing = readCaptureHeader(*stream, buffer->buffer, arrivalMicros);
+            readCaptureCursor(*stream, buffer->buffer);
+            if(!hasFrameData(buffer->buffer)){
+                pw_stream_queue_buffer(stream->stream, buffer);
+                continue;
+            }
+            if(newest){
+                pw_stream_queue_buffer(stream->stream, newest);
+                stream->stats.count(stream->stats.framesDropped);
+            }
+            newest = buffer;
+            newestTiming = timing;
+        }
+        if(newest){
+            self->holdCaptureBuffer(*stream, newest, newestTiming);
+        }else if(!dequeued){
+            stream->stats.count(stream->stats.bufferUnderruns);
+        }
+        return;
+    }
+
+    // Block leaves buffers with the stream while the queue is full, so the source runs out
+    // of buffers instead of frames being lost; popCapturedFrame drains them.
+    const CaptureQueue& queue = stream->captureQueue;
+    if(queue.isEnabled() && queue.isFull() && queue.policy == QueuePolicy::Block){
+        return;
+    }
+
+    pw_buffer* buffer = pw_stream_dequeue_buffer(stream->stream);
+    if(!buffer){
+        stream->stats.count(stream->stats.bufferUnderruns);
+        return;
+    }
+    self->processCaptureBuffer(*stream, buffer, arrivalMicros);
+}
+
+void ofxPipeWire::onAudioPublishProcess(void* data){
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    if(!self || !self->audioPublishStream){
+        return;
+    }
+
+    pw_buffer* buffer = pw_stream_dequeue_buffer(self->audioPublishStream);
+    if(!buffer){
+        self->audioPublishStats.count(self->audioPublishStats.bufferUnderruns);
+        return;
+    }
+    self->audioPublishStats.count(self->audioPublishStats.framesProcessed);
+
+    const uint32_t layout = self->audioPublishState.layout.load(std::memory_order_acquire);
+    const uint32_t channels = layout & ~AudioStreamState::planarBit;
+    float* planes[maxAudioChannels];
+    uint32_t step = 0;
+    uint32_t frames = 0;
+    if(mapAudioPlanes(buffer->buffer, layout, false, planes, step, frames)){
+        if(buffer->requested > 0){
+            frames = static_cast<uint32_t>(std::min<uint64_t>(frames, buffer->requested));
+        }
+        // Whatever the ring cannot supply goes out as silence.
+        if(popAudio(self->audioPublishRing, planes, step, channels, frames, self->audioPublishScratch) < frames){
+            self->audioPublishStats.count(self->audioPublishStats.bufferUnderruns);
+        }
+
+        spa_buffer* spaBuffer = buffer->buffer;
+        const uint32_t chunkCount = (layout & AudioStreamState::planarBit) ? channels : 1;
+        for(uint32_t i = 0; i < chunkCount; ++i){
+            spa_chunk* chunk = spaBuffer->datas[i].chunk;
+            chunk->offset = 0;
+            chunk->stride = static_cast<int32_t>(step * sizeof(float));
+            chunk->size = frames * step * sizeof(float);
+        }
+    }else if(buffer->buffer && buffer->buffer->n_datas > 0 && buffer->buffer->datas[0].chunk){
+        buffer->buffer->datas[0].chunk->size = 0;
+    }
+
+    pw_stream_queue_buffer(self->audioPublishStream, buffer);
+}
+
+void ofxPipeWire::onAudioCaptureProcess(void* data){
+    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
+    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
+    if(!self || !self->audioCaptureStream){
+        return;
+    }
+
+    pw_buffer* buffer = pw_stream_dequeue_buffer(self->audioCaptureStream);
+    if(!buffer){
+        self->audioCaptureStats.count(self->audioCaptureStats.bufferUnderruns);
+        return;
+    }
+    self->audioCaptureStats.count(self->audioCaptureStats.framesProcessed);
+
+    const uint32_t layout = self->audioCaptureState.layout.load(std::memory_order_acquire);
+    float* planes[maxAudioChannels];
+    uint32_t step = 0;
+    uint32_t frames = 0;
+    if(mapAudioPlanes(buffer->buffer, layout, true, planes, step, frames)){
+        // A full ring drops the newest samples rather than waiting for the app.
+        const size_t pushed = pushAudio(self->audioCaptureRing, planes, step, layout & ~AudioStreamState::planarBit,
+                                        frames, self->audioCaptureScratch);
+        if(pushed < frames){
+            self->audioCaptureStats.count(self->audioCaptureStats.framesDropped, frames - pushed);
+        }
+    }
+
+    pw_stream_queue_buffer(self->audioCaptureStream, buffer);
+}
+
+bool ofxPipeWire::mapAudioPlanes(spa_buffer* buffer, uint32_t layout, bool useChunks,
+                                 float** planes, uint32_t& step, uint32_t& frames){
+    const uint32_t channels = layout & ~AudioStreamState::planarBit;
+    const bool planar = (layout & AudioStreamState::planarBit) != 0;
+    if(!buffer || channels == 0 || channels > maxAudioChannels){
+        return false;
+    }
+
+    // Interleaved audio is one block with a stride of all channels; planar has a block per channel.
+    const uint32_t blocks = planar ? channels : 1;
+    if(buffer->n_datas < blocks){
+        return false;
+    }
+    step = planar ? 1 : channels;
+    frames = ~0u;
+    for(uint32_t i = 0; i < blocks; ++i){
+        spa_data& data = buffer->datas[i];
+        if(!data.data || !data.chunk){
+            return false;
+        }
+        uint32_t offset = useChunks ? std::min(data.chunk->offset, data.maxsize) : 0;
+        uint32_t bytes = useChunks ? std::min(data.chunk->size, data.maxsize - offset) : data.maxsize;
+        frames = std::min(frames, bytes / static_cast<uint32_t>(step * sizeof(float)));
+        float* base = reinterpret_cast<float*>(static_cast<uint8_t*>(data.data) + offset);
+        if(planar){
+            planes[i] = base;
+        }else{
+            for(uint32_t c = 0; c < channels; ++c){
+                planes[c] = base + c;
+            }
+        }
+    }
+    return true;
+}
+
+size_t ofxPipeWire::popAudio(AudioRing& ring, float* const* planes, uint32_t step, uint32_t channels,
+                             size_t frames, std::vector<float>& scratch){
+    const uint32_t ringChannels = static_cast<uint32_t>(ring.getChannels());
+    size_t done = 0;
+    if(step == channels && channels == ringChannels){
+        done = ring.read(planes[0], frames);
+    }else if(!scratch.empty()){
+        // Remap channels block by block; extra channels on our side are dropped, missing ones are silent.
+        const size_t blockFrames = scratch.size() / ringChannels;
+        while(done < frames){
+            size_t count = ring.read(scratch.data(), std::min(blockFrames, frames - done));
+            if(count == 0){
+                break;
+            }
+            for(size_t f = 0; f < count; ++f){
+                const float* frame = scratch.data() + f * ringChannels;
+                for(uint32_t c = 0; c < channels; ++c){
+                    planes[c][(done + f) * step] = c < ringChannels ? frame[c] : 0.0f;
+                }
+            }
+            done += count;
+        }
+    }
+
+    for(size_t f = done; f < frames; ++f){
+        for(uint32_t c = 0; c < channels; ++c){
+            planes[c][f * step] = 0.0f;
+        }
+    }
+    return done;
+}
+
+size_t ofxPipeWire::pushAudio(AudioRing& ring, const float* const* planes, uint32_t step, uint32_t channels,
+                              size_t frames, std::vector<float>& scratch){
+    const uint32_t ringChannels = static_cast<uint32_t>(ring.getChannels());
+    if(step == channels && channels == ringChannels){
+        return ring.write(planes[0], frames);
+    }
+    if(scratch.empty()){
+        return 0;
+    }
+
+    const size_t blockFrames = scratch.size() / ringChannels;
+    size_t done = 0;
+    while(done < frames){
+        const size_t count = std::min(blockFrames, frames - done);
+        for(size_t f = 0; f < count; ++f){
+            float* frame = scratch.data() + f * ringChannels;
+            for(uint32_t c = 0; c < ringChannels; ++c){
+                frame[c] = c < channels ? planes[c][(done + f) * step] : 0.0f;
+            }
+        }
+        const size_t written = ring.write(scratch.data(), count);
+        done += written;
+        if(written < count){
+            break;
+        }
+    }
+    return done;
+}
+
+void ofxPipeWire::holdCaptureBuffer(VideoStream& stream, pw_buffer* buffer, const FrameTiming& timing){
+    BufferState* state = static_cast<BufferState*>(buffer->user_data);
+    const NegotiatedVideo& info = stream.info;
+    ofxPipeWireConvert::Planes planes;
+    if(!state || !mapBufferPlanes(buffer->buffer, info, true, planes)){
+        pw_stream_queue_buffer(stream.stream, buffer);
+        return;
+    }
+
+    const Rect region = getCaptureRegion(stream, buffer->buffer);
+    state->info = getRegionInfo(info, region);
+    state->planes = ofxPipeWireConvert::offsetPlanes(planes, info.format, region.x, region.y);
+    state->sequence = ++stream.captureSequence;
+    state->arrivalMicros = timing.arrivalNanos / 1000;
+    state->timing = timing;
+
+    pw_buffer* previous = stream.heldCaptureBuffer.exchange(buffer, std::memory_order_acq_rel);
+    if(previous){
+        pw_stream_queue_buffer(stream.stream, previous);
+        stream.stats.count(stream.stats.framesDropped);
+    }
+}
+
+void ofxPipeWire::releaseCapturedBuffer(StreamHandle handle, uint64_t connectGeneration, uint64_t bufferEpoch,
+                                        pw_buffer* buffer){
+    // A removed or reconnected stream, or one whose buffers were replaced after a format
+    // change, has already taken this buffer back and may have freed it.
+    VideoStream* stream = findStream(handle, false);
+    LoopLock lock(threadLoop);
+    if(stream && stream->stream && stream->connectGeneration == connectGeneration &&
+       stream->bufferEpoch == bufferEpoch){
+        pw_stream_queue_buffer(stream->stream, buffer);
+    }
+}
+
+void ofxPipeWire::processCaptureBuffer(VideoStream& stream, pw_buffer* buffer, uint64_t arrivalMicros){
+    stream.stats.count(stream.stats.framesProcessed);
+    FrameTiming timing = readCaptureHeader(stream, buffer->buffer, arrivalMicros);
+    readCaptureCursor(stream, buffer->buffer);
+    if(hasFrameData(buffer->buffer)){
+        handleCaptureBuffer(stream, buffer, timing);
+    }
+    pw_stream_queue_buffer(stream.stream, buffer);
+}
+
+void ofxPipeWire::handleCaptureBuffer(VideoStream& stream, pw_buffer* buffer, const FrameTiming& timing){
+    if(!buffer){
+        return;
+    }
+
+    ofxPipeWireConvert::Planes bufferPlanes;
+    if(!mapBufferPlanes(buffer->buffer, stream.info, true, bufferPlanes)){
+        return;
     }
 
-    if(core){
-        pw_core_disconnect(core);
-        core = nullptr;
+    // Every slot collects the damage it misses; the write slot then only converts its own backlog.
+    const Damage damage = readCaptureDamage(buffer->buffer, stream.info);
+    for(CaptureSlot& pending : stream.captureSlots){
+        pending.pendingDamage.add(damage);
     }
 
-    if(context){
-        pw_context_destroy(context);
-        context = nullptr;
+    for(CaptureSlot& pending : stream.captureQueue.frames){
+        pending.pendingDamage.add(damage);
     }
 
-    if(mainLoop){
-        pw_main_loop_destroy(mainLoop);
-        mainLoop = nullptr;
+    // Only the cropped region is read; the rest of the buffer is never touched.
+    const Rect region = getCaptureRegion(stream, buffer->buffer);
+    const NegotiatedVideo info = getRegionInfo(stream.info, region);
+    const ofxPipeWireConvert::ConstPlanes planes = ofxPipeWireConvert::offsetPlanes(
+        ofxPipeWireConvert::ConstPlanes(bufferPlanes), info.format, region.x, region.y);
+
+    if(stream.captureQueue.isEnabled()){
+        if(CaptureSlot* slot = pushCaptureQueue(stream)){
+            fillCaptureSlot(stream, *slot, planes, info, region, timing);
+            if(threadLoop){
+                pw_thread_loop_signal(threadLoop, false);
+            }
+        }
+        return;
     }
 
-    pw_deinit();
+    // The write slot belongs to this thread; it only reallocates after a format change.
+    CaptureSlot& slot = stream.captureSlots[stream.captureBuffers.writeIndex()];
+    fillCaptureSlot(stream, slot, planes, info, region, timing);
+    if(stream.captureBuffers.publish()){
+        stream.stats.count(stream.stats.framesDropped);
+    }
 }
 
-spa_pod* ofxPipeWire::buildVideoFormat(spa_pod_builder& builder){
-    spa_video_format formats[4] = {
-        SPA_VIDEO_FORMAT_RGBA,
-        SPA_VIDEO_FORMAT_BGRA,
-        SPA_VIDEO_FORMAT_RGBx,
-        SPA_VIDEO_FORMAT_BGRx
-    };
-
-    if(!preferredFormats.empty()){
-        std::vector<spa_video_format> ordered;
-        ordered.reserve(4);
-        for(const auto& pref : preferredFormats){
-            spa_video_format fmt = toSpaFormat(pref);
-            if(std::find(ordered.begin(), ordered.end(), fmt) == ordered.end()){
-                ordered.push_back(fmt);
-            }
+void ofxPipeWire::fillCaptureSlot(VideoStream& stream, CaptureSlot& slot, const ofxPipeWireConvert::ConstPlanes& planes,
+                                  const NegotiatedVideo& info, const Rect& region, const FrameTiming& timing){
+    const bool patch = slot.pixelsSequence != 0 && isSameLayout(slot.info, info) &&
+                       slot.region.x == region.x && slot.region.y == region.y &&
+                       slot.pixels.getPixelFormat() == captureOutputFormat;
+    slot.info = info;
+    slot.region = region;
+    slot.sequence = ++stream.captureSequence;
+    slot.arrivalMicros = timing.arrivalNanos / 1000;
+    slot.timing = timing;
+    if(captureMode == CaptureMode::Lazy){
+        // Keep the negotiated bytes; the app converts them only if it reads this frame.
+        if(slot.raw.size() != info.layout.size){
+            slot.raw.resize(info.layout.size);
         }
-        for(const auto& fallback : formats){
-            if(std::find(ordered.begin(), ordered.end(), fallback) == ordered.end()){
-                ordered.push_back(fallback);
-            }
+        ofxPipeWireConvert::copyBlock(planes, ofxPipeWireConvert::makePlanes(slot.raw.data(), info.layout),
+                                      info.format, info.width, info.height);
+    }else{
+        uint64_t start = getMonotonicMicros();
+        allocateCapturePixels(slot.pixels, info);
+        if(patch){
+            const Damage regionDamage = getRegionDamage(slot.pendingDamage, region);
+            convertFromFormat(planes, slot.pixels, info, &regionDamage);
+        }else{
+            convertFromFormat(planes, slot.pixels, info);
         }
-        for(size_t i = 0; i < 4 && i < ordered.size(); ++i){
-            formats[i] = ordered[i];
+        stream.stats.addConvertTime(getMonotonicMicros() - start);
+        slot.pixelsSequence = slot.sequence;
+    }
+    slot.pendingDamage.clear();
+}
+
+ofxPipeWire::CaptureSlot* ofxPipeWire::pushCaptureQueue(VideoStream& stream){
+    CaptureQueue& queue = stream.captureQueue;
+    const size_t depth = queue.frames.size();
+    if(queue.isFull()){
+        stream.stats.count(stream.stats.framesDropped);
+        stream.stats.count(stream.stats.queueDropped);
+        // Block only gets here when a buffer was already dequeued; it is dropped like DropNewest.
+        if(queue.policy != QueuePolicy::DropOldest){
+            return nullptr;
         }
+        queue.head = (queue.head + 1) % depth;
+        --queue.count;
     }
 
-    return reinterpret_cast<spa_pod*>(
-        spa_pod_builder_add_object(&builder,
-            SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-            SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
-            SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
-            SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(4,
-                formats[0], formats[1], formats[2], formats[3]),
-            SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
-                SPA_RECTANGLE(videoConfig.width, videoConfig.height),
-                SPA_RECTANGLE(16, 16),
-                SPA_RECTANGLE(8192, 8192)),
-            SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
-                SPA_FRACTION(videoConfig.fps, 1),
-                SPA_FRACTION(1, 1),
-                SPA_FRACTION(240, 1))
-        )
-    );
+    CaptureSlot& slot = queue.frames[(queue.head + queue.count) % depth];
+    ++queue.count;
+    stream.stats.queuedFrames.store(queue.count, std::memory_order_relaxed);
+    return &slot;
 }
 
-ofxPipeWire::NegotiatedVideo ofxPipeWire::getDefaultVideoInfo() const{
-    NegotiatedVideo info;
-    info.width = videoConfig.width;
-    info.height = videoConfig.height;
-    info.fps = videoConfig.fps;
-    if(!preferredFormats.empty()){
-        info.format = toSpaFormat(preferredFormats.front());
-    }else{
-        info.format = SPA_VIDEO_FORMAT_RGBx;
+void ofxPipeWire::allocateCaptureQueue(VideoStream& stream){
+    // Only free frames are sized; queued ones keep the format they were captured in.
+    CaptureQueue& queue = stream.captureQueue;
+    const NegotiatedVideo& info = stream.info;
+    if(!info.negotiated){
+        return;
+    }
+    for(size_t i = queue.count; i < queue.frames.size(); ++i){
+        CaptureSlot& slot = queue.frames[(queue.head + i) % queue.frames.size()];
+        if(captureMode == CaptureMode::Lazy){
+            slot.raw.resize(info.layout.size);
+        }else{
+            allocateCapturePixels(slot.pixels, info);
+        }
+        slot.pendingDamage.setFull();
     }
-    info.stride = static_cast<uint32_t>(videoConfig.width * 4);
-    info.valid = true;
-    return info;
 }
 
-bool ofxPipeWire::createPublishStream(){
-    pw_properties* props = pw_properties_new(
-        PW_KEY_MEDIA_TYPE, "Video",
-        PW_KEY_MEDIA_CATEGORY, "Capture",
-        PW_KEY_MEDIA_ROLE, "Screen",
-        PW_KEY_APP_NAME, appName.c_str(),
-        PW_KEY_NODE_NAME, nodeName.c_str(),
-        nullptr
-    );
+void ofxPipeWire::drainCaptureQueue(VideoStream& stream){
+    if(!stream.stream){
+        return;
+    }
+    const uint64_t now = getMonotonicMicros();
+    while(!stream.captureQueue.isFull()){
+        pw_buffer* buffer = pw_stream_dequeue_buffer(stream.stream);
+        if(!buffer){
+            break;
+        }
+        processCaptureBuffer(stream, buffer, now);
+    }
+}
 
-    if(!publishTargetObject.empty()){
-        pw_properties_set(props, PW_KEY_TARGET_OBJECT, publishTargetObject.c_str());
+bool ofxPipeWire::acquirePublishGeneration(VideoStream& stream, uint64_t& generation){
+    if(stream.publishBuffers.acquire()){
+        stream.hasPublishFrame = true;
+    }
+    generation = 0;
+    if(!stream.hasPublishFrame){
+        return true;
     }
 
-    publishStream = pw_stream_new(core, "ofxPipeWire Publish", props);
-    if(!publishStream){
-        ofLogError("ofxPipeWire") << "Failed to create publish stream";
+    // A slot converted for a previous format cannot be sent.
+    const NegotiatedVideo& info = stream.info;
+    const PublishSlot& slot = stream.publishSlots[stream.publishBuffers.readIndex()];
+    if(!isSameLayout(slot.info, info)){
         return false;
     }
+    generation = slot.generation;
+    return true;
+}
 
-    publishListenerData.self = this;
-    publishListenerData.isPublish = true;
-
-    static const pw_stream_events publishEvents = {
-        PW_VERSION_STREAM_EVENTS,
-        .state_changed = ofxPipeWire::onStreamStateChanged,
-        .param_changed = ofxPipeWire::onStreamParamChanged,
-        .process = ofxPipeWire::onPublishProcess
-    };
-
-    pw_stream_add_listener(publishStream, &publishListener, &publishEvents, &publishListenerData);
-
-    uint8_t buffer[1024];
-    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-    const spa_pod* params[1];
-    params[0] = buildVideoFormat(builder);
+void ofxPipeWire::fillPublishBuffer(VideoStream& stream, pw_buffer* buffer, uint64_t generation){
+    if(!buffer || !buffer->buffer || buffer->buffer->n_datas == 0){
+        return;
+    }
 
-    int res = pw_stream_connect(
-        publishStream,
-        PW_DIRECTION_OUTPUT,
-        PW_ID_ANY,
-        static_cast<pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
-        params,
-        1
-    );
+    // The stream info is written by param_changed on this same thread.
+    const NegotiatedVideo& info = stream.info;
+    spa_buffer* spaBuffer = buffer->buffer;
+    ofxPipeWireConvert::Planes planes;
+    if(!mapBufferPlanes(spaBuffer, info, false, planes)){
+        if(spaBuffer->datas[0].chunk){
+            spaBuffer->datas[0].chunk->size = 0;
+        }
+        return;
+    }
 
-    if(res < 0){
-        ofLogError("ofxPipeWire") << "Failed to connect publish stream";
-        return false;
+    // Buffers cycle through the stream; one that already holds this generation is sent as is.
+    BufferState* state = static_cast<BufferState*>(buffer->user_data);
+    if(!state || state->generation != generation){
+        if(generation != 0){
+            // Only the areas changed since the generation this buffer last carried are copied.
+            const PublishSlot& slot = stream.publishSlots[stream.publishBuffers.readIndex()];
+            ofxPipeWireConvert::ConstPlanes src = ofxPipeWireConvert::makePlanes(slot.data.data(), info.layout);
+            Damage damage = state ? getDamageSince(slot.damage, state->generation, generation) : Damage();
+            if(damage.full){
+                ofxPipeWireConvert::copyPlanes(src, planes, info.layout);
+            }
+            for(int i = 0; i < damage.count; ++i){
+                const Rect& rect = damage.rects[i];
+                ofxPipeWireConvert::copyBlock(ofxPipeWireConvert::offsetPlanes(src, info.format, rect.x, rect.y),
+                                              ofxPipeWireConvert::offsetPlanes(planes, info.format, rect.x, rect.y),
+                                              info.format, rect.width, rect.height);
+            }
+        }else{
+            ofxPipeWireConvert::clearPlanes(planes, info.format, info.layout, info.range);
+        }
+        if(state){
+            state->generation = generation;
+        }
     }
 
-    return true;
+    writePublishChunks(spaBuffer, info.layout);
 }
 
-bool ofxPipeWire::createCaptureStream(){
-    pw_properties* props = pw_properties_new(
-        PW_KEY_MEDIA_TYPE, "Video",
-        PW_KEY_MEDIA_CATEGORY, "Playback",
-        PW_KEY_MEDIA_ROLE, "Screen",
-        PW_KEY_APP_NAME, appName.c_str(),
-        PW_KEY_NODE_NAME, nodeName.c_str(),
-        nullptr
-    );
+bool ofxPipeWire::hasFrameData(spa_buffer* buffer){
+    // Pointer-only updates arrive as buffers with an empty first chunk.
+    return buffer && buffer->n_datas > 0 && buffer->datas[0].chunk && buffer->datas[0].chunk->size > 0;
+}
 
-    if(!captureTargetObject.empty()){
-        pw_properties_set(props, PW_KEY_TARGET_OBJECT, captureTargetObject.c_str());
+void ofxPipeWire::readCaptureCursor(VideoStream& stream, spa_buffer* buffer){
+    spa_meta* meta = spa_buffer_find_meta(buffer, SPA_META_Cursor);
+    if(!meta || meta->size < sizeof(spa_meta_cursor)){
+        return;
     }
 
-    captureStream = pw_stream_new(core, "ofxPipeWire Capture", props);
-    if(!captureStream){
-        ofLogError("ofxPipeWire") << "Failed to create capture stream";
-        return false;
+    // An id of 0 means the source has no pointer over the stream right now.
+    const spa_meta_cursor* cursor = static_cast<const spa_meta_cursor*>(meta->data);
+    CursorSlot& latest = stream.cursorLatest;
+    const CursorInfo previous = latest.info;
+    latest.info.visible = cursor->id != 0;
+    if(latest.info.visible){
+        latest.info.x = cursor->position.x;
+        latest.info.y = cursor->position.y;
+        latest.info.hotspotX = cursor->hotspot.x;
+        latest.info.hotspotY = cursor->hotspot.y;
+    }
+
+    // The bitmap only comes along when it changed.
+    if(latest.info.visible && cursor->bitmap_offset >= sizeof(spa_meta_cursor) &&
+       cursor->bitmap_offset + sizeof(spa_meta_bitmap) <= meta->size){
+        const spa_meta_bitmap* bitmap = SPA_PTROFF(cursor, cursor->bitmap_offset, const spa_meta_bitmap);
+        const int width = static_cast<int>(bitmap->size.width);
+        const int height = static_cast<int>(bitmap->size.height);
+        const size_t end = cursor->bitmap_offset + bitmap->offset + static_cast<size_t>(std::max(bitmap->stride, 0)) * height;
+        ofxPipeWireConvert::RowConverter converter =
+            ofxPipeWireConvert::getRowConverter(static_cast<spa_video_format>(bitmap->format), SPA_VIDEO_FORMAT_RGBA);
+        latest.bitmapWidth = 0;
+        latest.bitmapHeight = 0;
+        if(width > 0 && height > 0 && bitmap->stride > 0 && end <= meta->size && converter.isValid()){
+            latest.bitmap.resize(static_cast<size_t>(width) * height * 4);
+            converter.convertRows(SPA_PTROFF(bitmap, bitmap->offset, const uint8_t), bitmap->stride,
+                                  latest.bitmap.data(), width * 4, width, height);
+            latest.bitmapWidth = width;
+            latest.bitmapHeight = height;
+        }
+        ++latest.info.bitmapSerial;
     }
 
-    captureListenerData.self = this;
-    captureListenerData.isPublish = false;
+    if(latest.info.visible != previous.visible || latest.info.x != previous.x || latest.info.y != previous.y ||
+       latest.info.hotspotX != previous.hotspotX || latest.info.hotspotY != previous.hotspotY ||
+       latest.info.bitmapSerial != previous.bitmapSerial){
+        publishCursor(stream);
+    }
+}
 
-    static const pw_stream_events captureEvents = {
-        PW_VERSION_STREAM_EVENTS,
-        .state_changed = ofxPipeWire::onStreamStateChanged,
-        .param_changed = ofxPipeWire::onStreamParamChanged,
-        .process = ofxPipeWire::onCaptureProcess
-    };
+void ofxPipeWire::writePublishCursor(VideoStream& stream, spa_buffer* buffer){
+    spa_meta* meta = spa_buffer_find_meta(buffer, SPA_META_Cursor);
+    if(!meta || meta->size < sizeof(spa_meta_cursor)){
+        return;
+    }
 
-    pw_stream_add_listener(captureStream, &captureListener, &captureEvents, &captureListenerData);
+    spa_meta_cursor* cursor = static_cast<spa_meta_cursor*>(meta->data);
+    const CursorSlot& slot = stream.cursorSlots[stream.cursorBuffers.readIndex()];
+    cursor->flags = 0;
+    cursor->bitmap_offset = 0;
+    if(!stream.hasCursor || !slot.info.visible){
+        cursor->id = 0;
+        return;
+    }
 
-    uint8_t buffer[1024];
-    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-    const spa_pod* params[1];
-    params[0] = buildVideoFormat(builder);
+    cursor->id = 1;
+    cursor->position.x = slot.info.x;
+    cursor->position.y = slot.info.y;
+    cursor->hotspot.x = slot.info.hotspotX;
+    cursor->hotspot.y = slot.info.hotspotY;
 
-    int res = pw_stream_connect(
-        captureStream,
-        PW_DIRECTION_INPUT,
-        PW_ID_ANY,
-        static_cast<pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
-        params,
-        1
-    );
+    // Like the bitmap a source sends, it is attached once per change; a sprite larger
+    // than the negotiated meta is left out.
+    const size_t bitmapBytes = static_cast<size_t>(slot.bitmapWidth) * slot.bitmapHeight * 4;
+    if(slot.info.bitmapSerial == stream.cursorSentSerial ||
+       sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap) + bitmapBytes > meta->size){
+        return;
+    }
 
-    if(res < 0){
-        ofLogError("ofxPipeWire") << "Failed to connect capture stream";
-        return false;
+    cursor->bitmap_offset = sizeof(spa_meta_cursor);
+    spa_meta_bitmap* bitmap = SPA_PTROFF(cursor, cursor->bitmap_offset, spa_meta_bitmap);
+    bitmap->format = SPA_VIDEO_FORMAT_RGBA;
+    bitmap->size.width = static_cast<uint32_t>(slot.bitmapWidth);
+    bitmap->size.height = static_cast<uint32_t>(slot.bitmapHeight);
+    bitmap->stride = slot.bitmapWidth * 4;
+    bitmap->offset = sizeof(spa_meta_bitmap);
+    if(bitmapBytes > 0){
+        memcpy(SPA_PTROFF(bitmap, bitmap->offset, uint8_t), slot.bitmap.data(), bitmapBytes);
     }
+    stream.cursorSentSerial = slot.info.bitmapSerial;
+}
 
-    return true;
+void ofxPipeWire::publishCursor(VideoStream& stream){
+    const CursorSlot& latest = stream.cursorLatest;
+    CursorSlot& slot = stream.cursorSlots[stream.cursorBuffers.writeIndex()];
+    if(slot.info.bitmapSerial != latest.info.bitmapSerial){
+        slot.bitmap.assign(latest.bitmap.begin(), latest.bitmap.begin() +
+                           static_cast<size_t>(latest.bitmapWidth) * latest.bitmapHeight * 4);
+        slot.bitmapWidth = latest.bitmapWidth;
+        slot.bitmapHeight = latest.bitmapHeight;
+    }
+    slot.info = latest.info;
+    stream.cursorBuffers.publish();
 }
 
-void ofxPipeWire::onRegistryGlobal(void* data, uint32_t id, uint32_t permissions,
-                                  const char* type, uint32_t version, const spa_dict* props){
-    (void)permissions;
-    (void)version;
-    ofxPipeWire* self = static_cast<ofxPipeWire*>(data);
-    if(!self || !type){
+void ofxPipeWire::writePublishDamage(spa_buffer* buffer, const Damage& damage, int width, int height){
+    spa_meta* meta = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+    const int capacity = meta ? static_cast<int>(meta->size / sizeof(spa_meta_region)) : 0;
+    if(capacity == 0){
         return;
     }
 
-    if(strcmp(type, PW_TYPE_INTERFACE_Node) == 0){
-        self->addNodeInfo(id, props);
-    }else if(strcmp(type, PW_TYPE_INTERFACE_Port) == 0){
-        self->addPortInfo(id, props);
+    Rect whole;
+    whole.width = width;
+    whole.height = height;
+    Rect bounds = damage.getBounds();
+    const Rect* rects = damage.rects.data();
+    int count = damage.count;
+    if(damage.full){
+        rects = &whole;
+        count = 1;
+    }else if(count > capacity){
+        rects = &bounds;
+        count = 1;
     }
-}
 
-void ofxPipeWire::onRegistryGlobalRemove(void* data, uint32_t id){
-    ofxPipeWire* self = static_cast<ofxPipeWire*>(data);
-    if(!self){
-        return;
+    // Regions run up to the first one with an empty size.
+    spa_meta_region* regions = static_cast<spa_meta_region*>(meta->data);
+    for(int i = 0; i < count; ++i){
+        regions[i].region.position.x = rects[i].x;
+        regions[i].region.position.y = rects[i].y;
+        regions[i].region.size.width = static_cast<uint32_t>(rects[i].width);
+        regions[i].region.size.height = static_cast<uint32_t>(rects[i].height);
+    }
+    if(count < capacity){
+        regions[count].region = spa_region();
     }
-    self->removeObject(id);
 }
 
-void ofxPipeWire::onStreamStateChanged(void* data, enum pw_stream_state oldState,
-                                      enum pw_stream_state state, const char* error){
-    (void)oldState;
-    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
-    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
-    if(!self){
-        return;
+ofxPipeWire::Damage ofxPipeWire::readCaptureDamage(spa_buffer* buffer, const NegotiatedVideo& info){
+    Damage damage;
+    spa_meta* meta = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+    if(!meta){
+        return damage;
     }
 
-    if(state == PW_STREAM_STATE_ERROR){
-        ofLogError("ofxPipeWire") << "Stream error: " << (error ? error : "unknown");
+    damage.clear();
+    spa_meta_region* region;
+    spa_meta_for_each(region, meta){
+        if(!spa_meta_region_is_valid(region)){
+            break;
+        }
+        Rect rect;
+        rect.x = region->region.position.x;
+        rect.y = region->region.position.y;
+        rect.width = static_cast<int>(region->region.size.width);
+        rect.height = static_cast<int>(region->region.size.height);
+        if(alignRect(rect, info.width, info.height)){
+            damage.add(rect);
+        }
     }
-    if(state == PW_STREAM_STATE_STREAMING){
-        ofLogNotice("ofxPipeWire") << "Stream is streaming";
+    // No usable region says nothing about what changed, so treat it as the whole frame.
+    if(damage.count == 0){
+        damage.setFull();
     }
+    return damage;
 }
 
-void ofxPipeWire::onStreamParamChanged(void* data, uint32_t id, const spa_pod* param){
-    if(id != SPA_PARAM_Format || param == nullptr){
-        return;
+ofxPipeWire::Damage ofxPipeWire::getDamageSince(const DamageHistory& history, uint64_t since, uint64_t generation){
+    Damage damage;
+    if(since == 0 || since == BufferState::unwritten || since > generation || generation - since > damageHistory){
+        return damage;
     }
 
-    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
-    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
-    if(!self){
-        return;
+    damage.clear();
+    for(uint64_t i = since + 1; i <= generation; ++i){
+        damage.add(history[i % damageHistory]);
     }
+    return damage;
+}
 
-    spa_video_info_raw info = {};
-    if(spa_format_video_raw_parse(param, &info) < 0){
-        return;
+bool ofxPipeWire::alignRect(Rect& rect, int width, int height){
+    int left = std::max(rect.x, 0) & ~1;
+    int top = std::max(rect.y, 0) & ~1;
+    int right = std::min(rect.x + rect.width, width);
+    int bottom = std::min(rect.y + rect.height, height);
+    if(right <= left || bottom <= top){
+        return false;
     }
 
-    self->onVideoFormatChanged(listenerData->isPublish, info);
+    right = std::min((right + 1) & ~1, width);
+    bottom = std::min((bottom + 1) & ~1, height);
+    rect.x = left;
+    rect.y = top;
+    rect.width = right - left;
+    rect.height = bottom - top;
+    return true;
 }
 
-void ofxPipeWire::onPublishProcess(void* data){
-    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
-    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
-    if(!self || !self->publishStream){
-        return;
-    }
-
-    pw_buffer* buffer = pw_stream_dequeue_buffer(self->publishStream);
-    if(!buffer){
-        return;
+bool ofxPipeWire::intersectRect(Rect& rect, const Rect& bounds){
+    const int left = std::max(rect.x, bounds.x);
+    const int top = std::max(rect.y, bounds.y);
+    const int right = std::min(rect.x + rect.width, bounds.x + bounds.width);
+    const int bottom = std::min(rect.y + rect.height, bounds.y + bounds.height);
+    if(right <= left || bottom <= top){
+        return false;
     }
 
-    self->fillPublishBuffer(buffer);
-    pw_stream_queue_buffer(self->publishStream, buffer);
+    rect.x = left;
+    rect.y = top;
+    rect.width = right - left;
+    rect.height = bottom - top;
+    return true;
 }
 
-void ofxPipeWire::onCaptureProcess(void* data){
-    StreamListenerData* listenerData = static_cast<StreamListenerData*>(data);
-    ofxPipeWire* self = listenerData ? listenerData->self : nullptr;
-    if(!self || !self->captureStream){
-        return;
+ofxPipeWire::Rect ofxPipeWire::getCaptureRegion(const VideoStream& stream, spa_buffer* buffer) const{
+    const NegotiatedVideo& info = stream.info;
+    Rect frame;
+    frame.width = info.width;
+    frame.height = info.height;
+
+    Rect region = frame;
+    const spa_meta_region* crop = static_cast<const spa_meta_region*>(
+        spa_buffer_find_meta_data(buffer, SPA_META_VideoCrop, sizeof(spa_meta_region)));
+    if(crop && spa_meta_region_is_valid(crop)){
+        region.x = crop->region.position.x;
+        region.y = crop->region.position.y;
+        region.width = static_cast<int>(crop->region.size.width);
+        region.height = static_cast<int>(crop->region.size.height);
+    }
+
+    const Rect& interest = stream.captureRegion;
+    if(interest.width > 0 && interest.height > 0){
+        Rect narrowed = interest;
+        narrowed.x += region.x;
+        narrowed.y += region.y;
+        if(intersectRect(narrowed, region)){
+            region = narrowed;
+        }
     }
 
-    pw_buffer* buffer = pw_stream_dequeue_buffer(self->captureStream);
-    if(!buffer){
-        return;
+    // Subsampled formats can only be cut at even pixels.
+    const bool even = ofxPipeWireConvert::isYuvFormat(info.format) ||
+                      ofxPipeWireConvert::isYuvFormat(toSpaFormat(captureOutputFormat));
+    if(even ? !alignRect(region, frame.width, frame.height) : !intersectRect(region, frame)){
+        return frame;
     }
-
-    self->handleCaptureBuffer(buffer);
-    pw_stream_queue_buffer(self->captureStream, buffer);
+    return region;
 }
 
-void ofxPipeWire::handleCaptureBuffer(pw_buffer* buffer){
-    if(!buffer || !buffer->buffer || buffer->buffer->datas[0].data == nullptr){
-        return;
+ofxPipeWire::NegotiatedVideo ofxPipeWire::getRegionInfo(const NegotiatedVideo& info, const Rect& region){
+    if(region.width == info.width && region.height == info.height){
+        return info;
     }
 
-    spa_buffer* spaBuffer = buffer->buffer;
-    spa_data* data = &spaBuffer->datas[0];
-    if(!data->chunk){
-        return;
+    NegotiatedVideo cropped = info;
+    cropped.width = region.width;
+    cropped.height = region.height;
+    ofxPipeWireConvert::getPlaneLayout(cropped.format, cropped.width, cropped.height, 0, cropped.layout);
+    cropped.stride = cropped.layout.stride[0];
+    return cropped;
+}
+
+ofxPipeWire::Damage ofxPipeWire::getRegionDamage(const Damage& damage, const Rect& region){
+    Damage result;
+    if(damage.full){
+        return result;
     }
 
-    NegotiatedVideo info = captureInfo.valid ? captureInfo : getDefaultVideoInfo();
-    const uint8_t* src = static_cast<const uint8_t*>(data->data) + data->chunk->offset;
-    uint32_t stride = data->chunk->stride;
-    if(stride == 0){
-        stride = info.stride > 0 ? info.stride : static_cast<uint32_t>(info.width * 4);
+    result.clear();
+    for(int i = 0; i < damage.count; ++i){
+        Rect rect = damage.rects[i];
+        if(intersectRect(rect, region)){
+            rect.x -= region.x;
+            rect.y -= region.y;
+            result.add(rect);
+        }
     }
+    return result;
+}
 
-    std::lock_guard<std::mutex> lock(captureMutex);
-    latestFrame.allocate(info.width, info.height, OF_PIXELS_RGBA);
-    convertFromFormat(src, static_cast<int>(stride), latestFrame, info);
-    hasLatestFrame = true;
+bool ofxPipeWire::isSameLayout(const NegotiatedVideo& a, const NegotiatedVideo& b){
+    return a.width == b.width && a.height == b.height && a.format == b.format && a.stride == b.stride;
 }
 
-void ofxPipeWire::fillPublishBuffer(pw_buffer* buffer){
-    if(!buffer || !buffer->buffer || buffer->buffer->datas[0].data == nullptr){
+void ofxPipeWire::Damage::add(const Rect& rect){
+    if(full){
         return;
     }
-
-    spa_buffer* spaBuffer = buffer->buffer;
-    spa_data* data = &spaBuffer->datas[0];
-    if(!data->chunk){
+    if(count == maxRects){
+        Rect bounds = getBounds();
+        int right = std::max(bounds.x + bounds.width, rect.x + rect.width);
+        int bottom = std::max(bounds.y + bounds.height, rect.y + rect.height);
+        bounds.x = std::min(bounds.x, rect.x);
+        bounds.y = std::min(bounds.y, rect.y);
+        bounds.width = right - bounds.x;
+        bounds.height = bottom - bounds.y;
+        rects[0] = bounds;
+        count = 1;
         return;
     }
+    rects[count++] = rect;
+}
 
-    NegotiatedVideo info = publishInfo.valid ? publishInfo : getDefaultVideoInfo();
-    uint8_t* dst = static_cast<uint8_t*>(data->data) + data->chunk->offset;
-    uint32_t stride = data->chunk->stride;
-    if(stride == 0){
-        stride = info.stride > 0 ? info.stride : static_cast<uint32_t>(info.width * 4);
+void ofxPipeWire::Damage::add(const Damage& other){
+    if(other.full){
+        setFull();
+        return;
+    }
+    for(int i = 0; i < other.count; ++i){
+        add(other.rects[i]);
     }
+}
 
-    std::lock_guard<std::mutex> lock(publishMutex);
-    if(hasPublishFrame && publishFrame.isAllocated()){
-        convertToFormat(publishFrame, dst, static_cast<int>(stride), info);
-    }else{
-        for(int y = 0; y < info.height; ++y){
-            memset(dst + y * stride, 0, info.width * 4);
-        }
+ofxPipeWire::Rect ofxPipeWire::Damage::getBounds() const{
+    Rect bounds;
+    if(count == 0){
+        return bounds;
+    }
+
+    int right = 0;
+    int bottom = 0;
+    bounds.x = rects[0].x;
+    bounds.y = rects[0].y;
+    for(int i = 0; i < count; ++i){
+        bounds.x = std::min(bounds.x, rects[i].x);
+        bounds.y = std::min(bounds.y, rects[i].y);
+        right = std::max(right, rects[i].x + rects[i].width);
+        bottom = std::max(bottom, rects[i].y + rects[i].height);
+    }
+    bounds.width = right - bounds.x;
+    bounds.height = bottom - bounds.y;
+    return bounds;
+}
+
+void ofxPipeWire::writePublishHeader(VideoStream& stream, spa_buffer* buffer, uint64_t submitMicros, uint32_t flags){
+    const uint64_t sequence = stream.publishSequence.fetch_add(1, std::memory_order_relaxed);
+    spa_meta_header* header = static_cast<spa_meta_header*>(
+        spa_buffer_find_meta_data(buffer, SPA_META_Header, sizeof(spa_meta_header)));
+    if(!header){
+        return;
     }
 
-    data->chunk->offset = 0;
-    data->chunk->size = stride * info.height;
-    data->chunk->stride = stride;
+    header->flags = flags;
+    header->offset = 0;
+    header->pts = static_cast<int64_t>(submitMicros) * 1000;
+    header->dts_offset = 0;
+    header->seq = sequence;
 }
 
-void ofxPipeWire::onVideoFormatChanged(bool isPublish, const spa_video_info_raw& info){
+ofxPipeWire::FrameTiming ofxPipeWire::readCaptureHeader(VideoStream& stream, spa_buffer* buffer, uint64_t arrivalMicros){
+    FrameTiming timing;
+    timing.arrivalNanos = static_cast<int64_t>(arrivalMicros) * 1000;
+    const spa_meta_header* header = static_cast<const spa_meta_header*>(
+        spa_buffer_find_meta_data(buffer, SPA_META_Header, sizeof(spa_meta_header)));
+    if(!header){
+        return timing;
+    }
+
+    timing.hasHeader = true;
+    timing.pts = header->pts;
+    timing.sequence = header->seq;
+    timing.flags = header->flags;
+    // A sequence that goes backwards means the producer restarted, not that frames were lost.
+    if(stream.hasHeaderSequence && header->seq > stream.lastHeaderSequence + 1){
+        timing.missedFrames = header->seq - stream.lastHeaderSequence - 1;
+    }
+    stream.lastHeaderSequence = header->seq;
+    stream.hasHeaderSequence = true;
+    return timing;
+}
+
+void ofxPipeWire::onVideoFormatChanged(VideoStream& stream, const spa_video_info_raw& info){
+    const bool isPublish = stream.isPublish;
+    const VideoConfig& config = stream.config;
     NegotiatedVideo negotiated;
     negotiated.width = static_cast<int>(info.size.width);
     negotiated.height = static_cast<int>(info.size.height);
@@ -631,154 +3150,183 @@ void ofxPipeWire::onVideoFormatChanged(bool isPublish, const spa_video_info_raw&
     if(info.framerate.denom > 0){
         negotiated.fps = static_cast<int>(info.framerate.num / info.framerate.denom);
     }
-    negotiated.stride = info.stride[0];
-    if(negotiated.stride == 0){
-        negotiated.stride = static_cast<uint32_t>(negotiated.width * 4);
+    if(!ofxPipeWireConvert::getPlaneLayout(negotiated.format, negotiated.width, negotiated.height, 0, negotiated.layout)){
+        ofLogWarning("ofxPipeWire") << "Negotiated unsupported video format " << negotiated.format;
+    }else if(isPublish && config.tuning.strideAlign > 1){
+        ofxPipeWireConvert::getPlaneLayout(negotiated.format, negotiated.width, negotiated.height,
+                                           alignStride(negotiated.layout.stride[0], config.tuning.strideAlign),
+                                           negotiated.layout);
     }
+    negotiated.stride = negotiated.layout.stride[0];
+    negotiated.matrix = ofxPipeWireConvert::toColorMatrix(info.color_matrix, negotiated.height);
+    negotiated.range = ofxPipeWireConvert::toColorRange(info.color_range);
     negotiated.valid = true;
+    negotiated.negotiated = true;
+
+    // Pick the conversion kernel once per negotiated format rather than per pixel.
+    if(isPublish){
+        negotiated.converter = ofxPipeWireConvert::getFrameConverter(toSpaFormat(config.pixelFormat), negotiated.format,
+                                                                     negotiated.matrix, negotiated.range);
+    }else{
+        negotiated.converter = ofxPipeWireConvert::getFrameConverter(negotiated.format, toSpaFormat(captureOutputFormat),
+                                                                     negotiated.matrix, negotiated.range);
+    }
+    ofLogVerbose("ofxPipeWire") << "Using " << ofxPipeWireConvert::getKernelName() << " conversion kernels";
+
+    // As the producer, size the buffers for the format that was actually negotiated,
+    // and only when it differs so an unchanged renegotiation keeps the current buffers.
+    const NegotiatedVideo& previous = stream.info;
+    const bool changed = !previous.negotiated || previous.format != negotiated.format ||
+                         previous.width != negotiated.width || previous.height != negotiated.height ||
+                         previous.stride != negotiated.stride;
+    if(isPublish && changed && stream.stream && negotiated.layout.count > 0){
+        uint8_t buffer[256];
+        spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        const spa_pod* params[1];
+        params[0] = buildBuffers(builder, config.tuning, false, 1,
+                                 static_cast<uint32_t>(negotiated.layout.size), negotiated.layout.stride[0]);
+        if(params[0]){
+            pw_stream_update_params(stream.stream, params, 1);
+        }
+    }
 
+    // param_changed runs on the loop thread; submitFrame reads the publish info from the app thread.
+    // Capture info is only touched from the loop thread.
     if(isPublish){
-        publishInfo = negotiated;
+        // The slots hold the old layout, which process never sends; convert the last frame again
+        // here on the loop thread, so a source that stopped submitting still gets published.
+        std::lock_guard<std::mutex> lock(stream.publishMutex);
+        stream.info = negotiated;
+        if(changed && stream.lastSource.isAllocated()){
+            convertIntoSlot(stream, stream.lastSource, Damage());
+        }
         ofLogNotice("ofxPipeWire") << "Publish format: " << negotiated.width << "x" << negotiated.height;
     }else{
-        captureInfo = negotiated;
+        stream.info = negotiated;
+        allocateCaptureQueue(stream);
         ofLogNotice("ofxPipeWire") << "Capture format: " << negotiated.width << "x" << negotiated.height;
     }
 }
 
-void ofxPipeWire::ensurePublishFormat(const ofPixels& pixels, const NegotiatedVideo& info){
-    if(publishFrame.isAllocated() && publishFrame.getWidth() == info.width && publishFrame.getHeight() == info.height){
+void ofxPipeWire::onAudioFormatChanged(bool isPublish, const spa_audio_info_raw& info){
+    const uint32_t channels = std::min(info.channels, maxAudioChannels);
+    const bool planar = info.format == SPA_AUDIO_FORMAT_F32P;
+    if(channels == 0 || (!planar && info.format != SPA_AUDIO_FORMAT_F32)){
+        ofLogWarning("ofxPipeWire") << "Negotiated unsupported audio format " << info.format;
         return;
     }
 
-    if(pixels.getWidth() != info.width || pixels.getHeight() != info.height){
-        ofLogNotice("ofxPipeWire") << "Resizing input pixels to negotiated size";
-    }
+    AudioStreamState& state = isPublish ? audioPublishState : audioCaptureState;
+    state.rate = info.rate;
+    state.layout.store(channels | (planar ? AudioStreamState::planarBit : 0), std::memory_order_release);
 
-    publishFrame.allocate(info.width, info.height, OF_PIXELS_RGBA);
+    if(static_cast<int>(channels) != audioConfig.channels){
+        ofLogNotice("ofxPipeWire") << "Audio negotiated " << channels << " channels; the ring keeps "
+                                   << audioConfig.channels << " and remaps";
+    }
+    if(static_cast<int>(info.rate) != audioConfig.sampleRate){
+        ofLogWarning("ofxPipeWire") << "Audio negotiated " << info.rate << " Hz instead of "
+                                    << audioConfig.sampleRate << " Hz; samples are not resampled";
+    }
+    ofLogNotice("ofxPipeWire") << (isPublish ? "Audio publish" : "Audio capture") << " format: "
+                               << info.rate << " Hz, " << channels << (planar ? " planar" : " interleaved") << " channels";
 }
 
-void ofxPipeWire::convertToFormat(const ofPixels& src, uint8_t* dst, int dstStride, const NegotiatedVideo& info){
-    if(!dst || !src.isAllocated()){
+void ofxPipeWire::convertToFormat(const ofPixels& src, const ofxPipeWireConvert::Planes& dst, const NegotiatedVideo& info,
+                                  ofPixels& scratch, const Damage* damage){
+    if(!dst.data[0] || !src.isAllocated()){
+        return;
+    }
+
+    // The negotiated converter expects VideoConfig::pixelFormat; other layouts get their own.
+    spa_video_format sourceFormat = toSpaFormat(src.getPixelFormat());
+    ofxPipeWireConvert::FrameConverter fallback;
+    const ofxPipeWireConvert::FrameConverter* converter = &info.converter;
+    if(!converter->isValid() || converter->getSourceFormat() != sourceFormat){
+        fallback = ofxPipeWireConvert::getFrameConverter(sourceFormat, info.format, info.matrix, info.range);
+        converter = &fallback;
+    }
+    if(!converter->isValid()){
         return;
     }
 
-    ofPixels scaled = src;
+    const ofPixels* source = &src;
     if(src.getWidth() != info.width || src.getHeight() != info.height){
-        scaled.resize(info.width, info.height);
-    }
-
-    const uint8_t* srcData = scaled.getData();
-    int w = info.width;
-    int h = info.height;
-
-    if(info.format == SPA_VIDEO_FORMAT_RGBA){
-        for(int y = 0; y < h; ++y){
-            memcpy(dst + y * dstStride, srcData + y * w * 4, w * 4);
-        }
-        return;
-    }
-
-    for(int y = 0; y < h; ++y){
-        const uint8_t* srcRow = srcData + y * w * 4;
-        uint8_t* dstRow = dst + y * dstStride;
-        for(int x = 0; x < w; ++x){
-            const uint8_t r = srcRow[x * 4 + 0];
-            const uint8_t g = srcRow[x * 4 + 1];
-            const uint8_t b = srcRow[x * 4 + 2];
-            const uint8_t a = srcRow[x * 4 + 3];
-
-            switch(info.format){
-                case SPA_VIDEO_FORMAT_RGBx:
-                    dstRow[x * 4 + 0] = r;
-                    dstRow[x * 4 + 1] = g;
-                    dstRow[x * 4 + 2] = b;
-                    dstRow[x * 4 + 3] = 255;
-                    break;
-                case SPA_VIDEO_FORMAT_BGRx:
-                    dstRow[x * 4 + 0] = b;
-                    dstRow[x * 4 + 1] = g;
-                    dstRow[x * 4 + 2] = r;
-                    dstRow[x * 4 + 3] = 255;
-                    break;
-                case SPA_VIDEO_FORMAT_BGRA:
-                    dstRow[x * 4 + 0] = b;
-                    dstRow[x * 4 + 1] = g;
-                    dstRow[x * 4 + 2] = r;
-                    dstRow[x * 4 + 3] = a;
-                    break;
-                default:
-                    dstRow[x * 4 + 0] = r;
-                    dstRow[x * 4 + 1] = g;
-                    dstRow[x * 4 + 2] = b;
-                    dstRow[x * 4 + 3] = a;
-                    break;
-            }
+        if(scratch.getWidth() != info.width || scratch.getHeight() != info.height ||
+           scratch.getPixelFormat() != src.getPixelFormat()){
+            ofLogNotice("ofxPipeWire") << "Resizing input pixels to negotiated size";
+            scratch.allocate(info.width, info.height, src.getPixelFormat());
         }
+        src.resizeTo(scratch);
+        source = &scratch;
+    }
+
+    ofxPipeWireConvert::ConstPlanes planes = ofxPipeWireConvert::makePlanes(
+        source->getData(), getPixelsLayout(sourceFormat, info.width, info.height));
+    if(damage && !damage->full && source == &src){
+        for(int i = 0; i < damage->count; ++i){
+            const Rect& rect = damage->rects[i];
+            converter->convert(ofxPipeWireConvert::offsetPlanes(planes, sourceFormat, rect.x, rect.y),
+                               ofxPipeWireConvert::offsetPlanes(dst, info.format, rect.x, rect.y),
+                               rect.width, rect.height);
+        }
+        return;
     }
+    converter->convert(planes, dst, info.width, info.height);
 }
 
-void ofxPipeWire::convertFromFormat(const uint8_t* src, int srcStride, ofPixels& dst, const NegotiatedVideo& info){
-    if(!src || !dst.isAllocated()){
+void ofxPipeWire::convertFromFormat(const ofxPipeWireConvert::ConstPlanes& src, ofPixels& dst, const NegotiatedVideo& info,
+                                    const Damage* damage){
+    if(!src.data[0] || !dst.isAllocated()){
         return;
     }
 
-    int w = info.width;
-    int h = info.height;
-    uint8_t* dstData = dst.getData();
+    spa_video_format targetFormat = toSpaFormat(dst.getPixelFormat());
+    ofxPipeWireConvert::FrameConverter fallback;
+    const ofxPipeWireConvert::FrameConverter* converter = &info.converter;
+    if(!converter->isValid() || converter->getTargetFormat() != targetFormat){
+        fallback = ofxPipeWireConvert::getFrameConverter(info.format, targetFormat, info.matrix, info.range);
+        converter = &fallback;
+    }
+    if(!converter->isValid()){
+        return;
+    }
 
-    if(info.format == SPA_VIDEO_FORMAT_RGBA){
-        for(int y = 0; y < h; ++y){
-            memcpy(dstData + y * w * 4, src + y * srcStride, w * 4);
+    ofxPipeWireConvert::Planes planes = ofxPipeWireConvert::makePlanes(
+        dst.getData(), getPixelsLayout(targetFormat, info.width, info.height));
+    if(damage && !damage->full){
+        for(int i = 0; i < damage->count; ++i){
+            const Rect& rect = damage->rects[i];
+            converter->convert(ofxPipeWireConvert::offsetPlanes(src, info.format, rect.x, rect.y),
+                               ofxPipeWireConvert::offsetPlanes(planes, targetFormat, rect.x, rect.y),
+                               rect.width, rect.height);
         }
         return;
     }
+    converter->convert(src, planes, info.width, info.height);
+}
 
-    for(int y = 0; y < h; ++y){
-        const uint8_t* srcRow = src + y * srcStride;
-        uint8_t* dstRow = dstData + y * w * 4;
-        for(int x = 0; x < w; ++x){
-            uint8_t r = 0;
-            uint8_t g = 0;
-            uint8_t b = 0;
-            uint8_t a = 255;
-
-            switch(info.format){
-                case SPA_VIDEO_FORMAT_RGBx:
-                    r = srcRow[x * 4 + 0];
-                    g = srcRow[x * 4 + 1];
-                    b = srcRow[x * 4 + 2];
-                    a = 255;
-                    break;
-                case SPA_VIDEO_FORMAT_BGRx:
-                    b = srcRow[x * 4 + 0];
-                    g = srcRow[x * 4 + 1];
-                    r = srcRow[x * 4 + 2];
-                    a = 255;
-                    break;
-                case SPA_VIDEO_FORMAT_BGRA:
-                    b = srcRow[x * 4 + 0];
-                    g = srcRow[x * 4 + 1];
-                    r = srcRow[x * 4 + 2];
-                    a = srcRow[x * 4 + 3];
-                    break;
-                default:
-                    r = srcRow[x * 4 + 0];
-                    g = srcRow[x * 4 + 1];
-                    b = srcRow[x * 4 + 2];
-                    a = srcRow[x * 4 + 3];
-                    break;
-            }
+void ofxPipeWire::allocateCapturePixels(ofPixels& pixels, const NegotiatedVideo& info) const{
+    if(pixels.getWidth() != static_cast<size_t>(info.width) || pixels.getHeight() != static_cast<size_t>(info.height) ||
+       pixels.getPixelFormat() != captureOutputFormat){
+        pixels.allocate(info.width, info.height, captureOutputFormat);
+    }
+}
 
-            dstRow[x * 4 + 0] = r;
-            dstRow[x * 4 + 1] = g;
-            dstRow[x * 4 + 2] = b;
-            dstRow[x * 4 + 3] = a;
-        }
+ofxPipeWireConvert::PlaneLayout ofxPipeWire::getPixelsLayout(spa_video_format format, int width, int height){
+    // ofPixels rows carry no padding, and planar formats keep their planes back to back.
+    ofxPipeWireConvert::PackedLayout packed;
+    uint32_t stride = static_cast<uint32_t>(width);
+    if(ofxPipeWireConvert::getPackedLayout(format, packed)){
+        stride *= static_cast<uint32_t>(packed.bytesPerPixel);
     }
+
+    ofxPipeWireConvert::PlaneLayout layout;
+    ofxPipeWireConvert::getPlaneLayout(format, width, height, stride, layout);
+    return layout;
 }
 
-void ofxPipeWire::addNodeInfo(uint32_t id, const spa_dict* props){
+void ofxPipeWire::addNodeInfo(Connection& connection, uint32_t id, const spa_dict* props){
     if(!props){
         return;
     }
@@ -798,18 +3346,11 @@ void ofxPipeWire::addNodeInfo(uint32_t id, const spa_dict* props){
         info.objectSerial = value;
     }
 
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    auto it = std::find_if(nodes.begin(), nodes.end(), [id](const NodeInfo& node){
-        return node.id == id;
-    });
-    if(it != nodes.end()){
-        *it = info;
-    }else{
-        nodes.push_back(info);
-    }
+    connection.nodes[id] = std::move(info);
+    markDiscoveryChanged(connection);
 }
 
-void ofxPipeWire::addPortInfo(uint32_t id, const spa_dict* props){
+void ofxPipeWire::addPortInfo(Connection& connection, uint32_t id, const spa_dict* props){
     if(!props){
         return;
     }
@@ -829,28 +3370,83 @@ void ofxPipeWire::addPortInfo(uint32_t id, const spa_dict* props){
         info.nodeId = parseUint32(value);
     }
 
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    auto it = std::find_if(ports.begin(), ports.end(), [id](const PortInfo& port){
-        return port.id == id;
-    });
-    if(it != ports.end()){
-        *it = info;
-    }else{
-        ports.push_back(info);
+    connection.ports[id] = std::move(info);
+    markDiscoveryChanged(connection);
+}
+
+void ofxPipeWire::removeObject(Connection& connection, uint32_t id){
+    if(connection.nodes.erase(id) + connection.ports.erase(id) > 0){
+        markDiscoveryChanged(connection);
+    }
+}
+
+void ofxPipeWire::markDiscoveryChanged(Connection& connection){
+    ++connection.discoveryGeneration;
+    if(!connection.discoveryEvent){
+        publishDiscovery(connection);
+        return;
+    }
+    // The registry sends objects in bursts; the event runs once after the burst is handled.
+    if(!connection.discoveryPending){
+        connection.discoveryPending = true;
+        pw_loop_signal_event(connection.loop, connection.discoveryEvent);
     }
 }
 
-void ofxPipeWire::removeObject(uint32_t id){
-    std::lock_guard<std::mutex> lock(discoveryMutex);
-    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [id](const NodeInfo& node){
-        return node.id == id;
-    }), nodes.end());
-    ports.erase(std::remove_if(ports.begin(), ports.end(), [id](const PortInfo& port){
-        return port.id == id;
-    }), ports.end());
+void ofxPipeWire::onDiscoveryEvent(void* data, uint64_t count){
+    (void)count;
+    Connection* connection = static_cast<Connection*>(data);
+    if(!connection){
+        return;
+    }
+    connection->discoveryPending = false;
+    publishDiscovery(*connection);
+}
+
+void ofxPipeWire::publishDiscovery(Connection& connection){
+    // Built on the loop thread from the id-keyed maps, so readers never copy and the
+    // registry callbacks never wait for a reader.
+    std::shared_ptr<DiscoverySnapshot> snapshot = std::make_shared<DiscoverySnapshot>();
+    snapshot->generation = connection.discoveryGeneration;
+
+    snapshot->nodes.reserve(connection.nodes.size());
+    for(const auto& entry : connection.nodes){
+        const size_t index = snapshot->nodes.size();
+        const NodeInfo& node = entry.second;
+        snapshot->nodes.push_back(node);
+        snapshot->nodeIds.emplace(node.id, index);
+        if(!node.name.empty()){
+            snapshot->nodeNames.emplace(node.name, index);
+        }
+        if(!node.objectSerial.empty()){
+            snapshot->nodeSerials.emplace(node.objectSerial, index);
+        }
+        if(!node.mediaClass.empty()){
+            snapshot->nodeMediaClasses[node.mediaClass].push_back(index);
+        }
+        if(isVideoNode(node)){
+            snapshot->videoNodes.push_back(index);
+        }
+    }
+
+    snapshot->ports.reserve(connection.ports.size());
+    for(const auto& entry : connection.ports){
+        const size_t index = snapshot->ports.size();
+        const PortInfo& port = entry.second;
+        snapshot->ports.push_back(port);
+        snapshot->portIds.emplace(port.id, index);
+        snapshot->nodePorts[port.nodeId].push_back(index);
+    }
+
+    // The previous snapshot is released outside the lock, possibly by the last reader instead.
+    std::shared_ptr<const DiscoverySnapshot> previous = std::move(snapshot);
+    {
+        std::lock_guard<std::mutex> lock(connection.discoveryMutex);
+        connection.discovery.swap(previous);
+    }
 }
 
-bool ofxPipeWire::isVideoNode(const NodeInfo& node) const{
+bool ofxPipeWire::isVideoNode(const NodeInfo& node){
     if(node.mediaClass.empty()){
         return false;
     }
@@ -864,6 +3460,44 @@ uint32_t ofxPipeWire::parseUint32(const char* value){
     return static_cast<uint32_t>(strtoul(value, nullptr, 10));
 }
 
+uint64_t ofxPipeWire::getMonotonicMicros(){
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void ofxPipeWire::StatsCounters::addConvertTime(uint64_t micros){
+    lastConvertMicros.store(micros, std::memory_order_relaxed);
+    count(totalConvertMicros, micros);
+    count(convertCount);
+}
+
+void ofxPipeWire::StatsCounters::addLatency(uint64_t micros){
+    uint64_t millis = micros / 1000;
+    int bucket = 0;
+    while(bucket < StreamStats::latencyBuckets - 1 && millis >= (uint64_t(1) << bucket)){
+        ++bucket;
+    }
+    count(latency[bucket]);
+}
+
+ofxPipeWire::StreamStats ofxPipeWire::StatsCounters::getSnapshot() const{
+    StreamStats result;
+    result.framesProcessed = framesProcessed.load(std::memory_order_relaxed);
+    result.framesDropped = framesDropped.load(std::memory_order_relaxed);
+    result.bufferUnderruns = bufferUnderruns.load(std::memory_order_relaxed);
+    result.queuedFrames = queuedFrames.load(std::memory_order_relaxed);
+    result.queueDropped = queueDropped.load(std::memory_order_relaxed);
+    result.lastConvertMillis = lastConvertMicros.load(std::memory_order_relaxed) / 1000.0f;
+    const uint64_t converts = convertCount.load(std::memory_order_relaxed);
+    if(converts > 0){
+        result.averageConvertMillis = totalConvertMicros.load(std::memory_order_relaxed) / 1000.0f / converts;
+    }
+    for(int i = 0; i < StreamStats::latencyBuckets; ++i){
+        result.latencyHistogram[i] = latency[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
 spa_video_format ofxPipeWire::toSpaFormat(VideoFormatPreference format){
     switch(format){
         case VideoFormatPreference::RGBA:
@@ -874,9 +3508,44 @@ spa_video_format ofxPipeWire::toSpaFormat(VideoFormatPreference format){
             return SPA_VIDEO_FORMAT_RGBx;
         case VideoFormatPreference::BGRx:
             return SPA_VIDEO_FORMAT_BGRx;
+        case VideoFormatPreference::RGB:
+            return SPA_VIDEO_FORMAT_RGB;
+        case VideoFormatPreference::BGR:
+            return SPA_VIDEO_FORMAT_BGR;
+        case VideoFormatPreference::GRAY8:
+            return SPA_VIDEO_FORMAT_GRAY8;
+        case VideoFormatPreference::NV12:
+            return SPA_VIDEO_FORMAT_NV12;
+        case VideoFormatPreference::I420:
+            return SPA_VIDEO_FORMAT_I420;
+        case VideoFormatPreference::YUY2:
+            return SPA_VIDEO_FORMAT_YUY2;
+        case VideoFormatPreference::UYVY:
+            return SPA_VIDEO_FORMAT_UYVY;
         default:
             return SPA_VIDEO_FORMAT_RGBx;
     }
 }
 
+spa_video_format ofxPipeWire::toSpaFormat(ofPixelFormat format){
+    switch(format){
+        case OF_PIXELS_RGBA:
+            return SPA_VIDEO_FORMAT_RGBA;
+        case OF_PIXELS_BGRA:
+            return SPA_VIDEO_FORMAT_BGRA;
+        case OF_PIXELS_RGB:
+            return SPA_VIDEO_FORMAT_RGB;
+        case OF_PIXELS_BGR:
+            return SPA_VIDEO_FORMAT_BGR;
+        case OF_PIXELS_GRAY:
+            return SPA_VIDEO_FORMAT_GRAY8;
+        case OF_PIXELS_NV12:
+            return SPA_VIDEO_FORMAT_NV12;
+        case OF_PIXELS_I420:
+            return SPA_VIDEO_FORMAT_I420;
+        default:
+            return SPA_VIDEO_FORMAT_UNKNOWN;
+    }
+}
+
 #endif
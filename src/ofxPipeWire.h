@@ -2,32 +2,106 @@
 
 #include "ofMain.h"
 
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #ifdef TARGET_LINUX
 #include <pipewire/pipewire.h>
 #include <pipewire/keys.h>
+#include <pipewire/thread-loop.h>
+#include <spa/param/audio/format-utils.h>
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
 #include <spa/param/video/raw-utils.h>
 #include <spa/utils/dict.h>
+
+#include "ofxPipeWireConvert.h"
 #endif
 
 class ofxPipeWire {
 public:
+    // Identifies one video stream of an instance. Handles are never reused.
+    using StreamHandle = int;
+    static constexpr StreamHandle invalidStream = -1;
+
     enum class VideoFormatPreference {
         RGBA,
         BGRA,
         RGBx,
-        BGRx
+        BGRx,
+        RGB,    // 24-bit, no padding
+        BGR,
+        GRAY8,
+        NV12,   // 4:2:0, Y plane plus interleaved UV plane
+        I420,   // 4:2:0, separate Y, U and V planes
+        YUY2,   // 4:2:2 packed, Y0 U Y1 V
+        UYVY    // 4:2:2 packed, U Y0 V Y1
+    };
+
+    enum class LoopMode {
+        MainLoop,   // pumped by update() on the app thread
+        ThreadLoop  // runs on its own thread, update() is optional
+    };
+
+    enum class CaptureMode {
+        Convert,    // every buffer is converted to the capture output format for getLatestFrame()
+        Hold,       // the newest buffer stays mapped for acquireCapturedFrame()
+        Lazy        // raw bytes are kept; conversion happens when the app reads a new frame
+    };
+
+    // What a full capture queue does when the next buffer arrives.
+    enum class QueuePolicy {
+        DropOldest, // the oldest queued frame makes room for it
+        DropNewest, // the new frame is discarded
+        Block       // the buffer stays with PipeWire until a pop makes room, holding the source back
+    };
+
+    // Scheduling and buffer hints for one stream. Zero leaves the choice to PipeWire.
+    struct StreamTuning {
+        // node.latency as latencyFrames/latencyRate, e.g. 256/48000. A zero latencyRate
+        // uses rate, then the audio sample rate (or 48000 for video).
+        int latencyFrames = 0;
+        int latencyRate = 0;
+        // node.rate: the graph rate this stream asks for, in Hz.
+        int rate = 0;
+        // Buffers param: how many buffers, bytes per data block, and the alignment
+        // of data and video rows in bytes.
+        int minBuffers = 0;
+        int maxBuffers = 0;
+        int bufferSize = 0;
+        int strideAlign = 0;
     };
 
     struct VideoConfig {
         int width = 640;
         int height = 480;
         int fps = 30;
+        // fps is divided by this for fractional rates, e.g. 30000/1001.
+        int fpsDenominator = 1;
+        // Publish only, fixed when the stream is created: drive the graph and start a cycle
+        // every fpsDenominator/fps seconds from a monotonic timer. With LoopMode::ThreadLoop
+        // the pacing does not depend on update().
+        bool driver = false;
+        // Layout of the pixels given to submitFrame (RGBA, BGRA, RGB, BGR, GRAY, NV12 or I420).
+        // The publish stream offers the matching format first so nothing is expanded.
+        ofPixelFormat pixelFormat = OF_PIXELS_RGBA;
+        StreamTuning tuning;
+    };
+
+    struct AudioConfig {
+        int sampleRate = 48000;
+        int channels = 2;
+        // Prefer planar F32P over interleaved F32; both are offered.
+        bool planar = false;
+        // Capacity of each ring buffer in frames, rounded up to a power of two.
+        int ringFrames = 8192;
+        StreamTuning tuning;
     };
 
     struct NodeInfo {
@@ -46,34 +120,304 @@ public:
         std::string alias;
     };
 
+    // Immutable view of the discovered graph, shared by every reader. A new snapshot with a
+    // higher generation is published after each batch of registry changes, so holding one
+    // never copies or blocks anything; compare generations to see whether the graph changed.
+    class DiscoverySnapshot {
+    public:
+        uint64_t generation = 0;
+        // Both sorted by id.
+        std::vector<NodeInfo> nodes;
+        std::vector<PortInfo> ports;
+
+        const NodeInfo* findNode(uint32_t id) const;
+        // Names and serials are not guaranteed unique; the lowest id wins.
+        const NodeInfo* findNodeByName(const std::string& name) const;
+        const NodeInfo* findNodeByObjectSerial(const std::string& objectSerial) const;
+        // Exact media.class, e.g. "Video/Source".
+        std::vector<const NodeInfo*> findNodesByMediaClass(const std::string& mediaClass) const;
+        std::vector<const NodeInfo*> getVideoNodes() const;
+        const PortInfo* findPort(uint32_t id) const;
+        std::vector<const PortInfo*> findPortsByNode(uint32_t nodeId) const;
+
+    private:
+        friend class ofxPipeWire;
+
+        // Indices into nodes and ports.
+        std::unordered_map<uint32_t, size_t> nodeIds;
+        std::unordered_map<std::string, size_t> nodeNames;
+        std::unordered_map<std::string, size_t> nodeSerials;
+        std::unordered_map<std::string, std::vector<size_t>> nodeMediaClasses;
+        std::vector<size_t> videoNodes;
+        std::unordered_map<uint32_t, size_t> portIds;
+        std::unordered_map<uint32_t, std::vector<size_t>> nodePorts;
+    };
+
+    // A pixel rectangle within a frame, e.g. an area that changed.
+    struct Rect {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    // Pointer sent as SPA_META_Cursor next to the frames instead of drawn into them.
+    struct CursorInfo {
+        bool visible = false;
+        // Position in source frame pixels, and the hotspot inside the bitmap.
+        int x = 0;
+        int y = 0;
+        int hotspotX = 0;
+        int hotspotY = 0;
+        // Bumped whenever the bitmap changes.
+        uint64_t bitmapSerial = 0;
+    };
+
+    // Snapshot of one video stream's counters; cheap enough to read every frame.
+    struct StreamStats {
+        static constexpr int latencyBuckets = 10;
+
+        // Buffers queued (publish) or received (capture).
+        uint64_t framesProcessed = 0;
+        // Frames replaced before the other side consumed them.
+        uint64_t framesDropped = 0;
+        // Process callbacks that found no buffer to dequeue.
+        uint64_t bufferUnderruns = 0;
+        float lastConvertMillis = 0.0f;
+        float averageConvertMillis = 0.0f;
+        // Submit-to-queue (publish) or arrival-to-read (capture) times. Bucket i counts
+        // latencies under 2^i ms; the last bucket holds everything slower.
+        std::array<uint64_t, latencyBuckets> latencyHistogram{};
+        // Capture queue: frames waiting for popCapturedFrame() and frames the policy discarded.
+        // Queue drops are also part of framesDropped.
+        uint64_t queuedFrames = 0;
+        uint64_t queueDropped = 0;
+    };
+
+    // Per-frame timing from the producer's spa_meta_header. Without a header only
+    // arrivalNanos is set.
+    struct FrameTiming {
+        bool hasHeader = false;
+        // Presentation time in nanoseconds, in the producer's clock.
+        int64_t pts = 0;
+        uint64_t sequence = 0;
+        // SPA_META_HEADER_FLAG_* bits (discont, corrupted, gap, ...).
+        uint32_t flags = 0;
+        // Sequence numbers skipped between the previous header and this one.
+        uint64_t missedFrames = 0;
+        // CLOCK_MONOTONIC time the buffer reached the process callback.
+        int64_t arrivalNanos = 0;
+    };
+
+    // Graph timing of one stream from pw_stream_get_time_n.
+    struct StreamTime {
+        bool valid = false;
+        // CLOCK_MONOTONIC time the values were taken, in nanoseconds.
+        int64_t now = 0;
+        // Graph clock: ticks at rateNum/rateDenom seconds each.
+        uint32_t rateNum = 0;
+        uint32_t rateDenom = 0;
+        uint64_t ticks = 0;
+        // Time until a queued buffer is seen by the device or peer, in ticks and nanoseconds.
+        int64_t delay = 0;
+        int64_t delayNanos = 0;
+        uint32_t queuedBuffers = 0;
+        uint32_t availableBuffers = 0;
+    };
+
+    // Writable view of a dequeued publish buffer in the negotiated format.
+    // data/stride are the first plane; YUV formats fill planeCount planes.
+    struct PublishBuffer {
+        uint8_t* data = nullptr;
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+        int planeCount = 0;
+        uint8_t* planeData[3] = {nullptr, nullptr, nullptr};
+        int planeStride[3] = {0, 0, 0};
+        StreamHandle stream = invalidStream;
+        // A reconnect or format change in between makes the commit fail.
+        uint64_t connectGeneration = 0;
+        uint64_t bufferEpoch = 0;
+#ifdef TARGET_LINUX
+        spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN;
+        pw_buffer* buffer = nullptr;
+#endif
+
+        bool isValid() const{
+            return data != nullptr;
+        }
+    };
+
+    // Read-only view of a held capture buffer in the negotiated format.
+    // The buffer returns to the stream when the view is released or destroyed.
+    // A format change, renegotiation, retarget or shutdown takes the buffer away:
+    // data is invalid from then on and releasing the view only forgets it. The same
+    // holds once the ofxPipeWire is destroyed; the view never calls back into it.
+    class CapturedFrameView {
+    public:
+        CapturedFrameView() = default;
+        ~CapturedFrameView();
+        CapturedFrameView(CapturedFrameView&& other) noexcept;
+        CapturedFrameView& operator=(CapturedFrameView&& other) noexcept;
+        CapturedFrameView(const CapturedFrameView&) = delete;
+        CapturedFrameView& operator=(const CapturedFrameView&) = delete;
+
+        bool isValid() const{
+            return data != nullptr;
+        }
+        void release();
+
+        const uint8_t* data = nullptr;
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+        int planeCount = 0;
+        const uint8_t* planeData[3] = {nullptr, nullptr, nullptr};
+        int planeStride[3] = {0, 0, 0};
+        uint64_t sequence = 0;
+        FrameTiming timing;
+#ifdef TARGET_LINUX
+        spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN;
+#endif
+
+    private:
+        friend class ofxPipeWire;
+        std::weak_ptr<ofxPipeWire*> owner;
+        StreamHandle stream = invalidStream;
+        uint64_t connectGeneration = 0;
+        uint64_t bufferEpoch = 0;
+#ifdef TARGET_LINUX
+        pw_buffer* buffer = nullptr;
+#endif
+    };
+
     ofxPipeWire();
     ~ofxPipeWire();
 
     void setAppName(const std::string& name);
     void setNodeName(const std::string& name);
 
+    // After setup() this renegotiates every video stream in place.
     void setPreferredVideoFormats(const std::vector<VideoFormatPreference>& formats);
-
+    void setLoopMode(LoopMode mode);
+    // Both capture settings take effect at the next setup().
+    void setCaptureMode(CaptureMode mode);
+    // Layout getLatestFrame() returns: OF_PIXELS_RGBA (default), BGRA, RGB, BGR, GRAY,
+    // NV12 or I420. Captured buffers are converted straight into it in one pass.
+    void setCaptureOutputFormat(ofPixelFormat format);
+    // Only queue a publish buffer when submitFrame delivered something new.
+    void setPublishOnlyOnChange(bool onlyOnChange);
+
+    // Audio streams are created by setup() next to the video ones. Call before setup().
+    void setAudioEnabled(bool enablePublish, bool enableCapture);
+    void setAudioConfig(const AudioConfig& config);
+
+    // After setup() these reconnect the default stream in place; the connection,
+    // discovery cache and frame buffers are kept. An empty target autoconnects.
     void setPublishTargetNodeName(const std::string& nodeName);
     void setPublishTargetObjectSerial(const std::string& objectSerial);
     void setCaptureTargetNodeName(const std::string& nodeName);
     void setCaptureTargetObjectSerial(const std::string& objectSerial);
 
+    // Never null. Cheap enough to call every frame: it only copies a shared pointer.
+    std::shared_ptr<const DiscoverySnapshot> getDiscoverySnapshot() const;
+    // Copies of the current snapshot's lists.
     std::vector<NodeInfo> getNodes() const;
     std::vector<NodeInfo> getVideoNodes() const;
     std::vector<PortInfo> getPorts() const;
 
-    bool setup(bool enablePublish, bool enableCapture, const VideoConfig& config = VideoConfig());
+    bool setup(bool enablePublish, bool enableCapture);
+    bool setup(bool enablePublish, bool enableCapture, const VideoConfig& config);
     void update();
     void shutdown();
 
     bool isInitialized() const;
 
+    // More video streams on the same connection, after setup(). An empty target autoconnects.
+    // The calls without a handle use the streams setup() created.
+    StreamHandle addPublishStream(const std::string& target, const VideoConfig& config);
+    StreamHandle addCaptureStream(const std::string& target, const VideoConfig& config);
+    void removeStream(StreamHandle stream);
+    // Reconnects one stream to another node name or object serial.
+    bool setStreamTarget(StreamHandle stream, const std::string& target);
+    // Renegotiates size, rate or pixel format without reconnecting. Nothing happens
+    // when the requested format is unchanged; latency and graph rate changes only update
+    // the node properties. setVideoConfig applies to the default streams.
+    bool setStreamConfig(StreamHandle stream, const VideoConfig& config);
+    void setVideoConfig(const VideoConfig& config);
+    StreamHandle getDefaultPublishStream() const;
+    StreamHandle getDefaultCaptureStream() const;
+    StreamStats getStats(StreamHandle stream) const;
+    // Audio streams count buffers in framesProcessed, sample frames lost to a full capture ring
+    // in framesDropped, and failed dequeues plus publish cycles padded with silence in bufferUnderruns.
+    StreamStats getAudioPublishStats() const;
+    StreamStats getAudioCaptureStats() const;
+    StreamTime getStreamTime(StreamHandle stream) const;
+
     // Publish path (output stream)
     bool submitFrame(const ofPixels& pixels);
+    bool submitFrame(StreamHandle stream, const ofPixels& pixels);
+    // Only dirtyRects changed since the previous frame: just those areas are converted and
+    // advertised as damage. pixels must still hold the whole frame; an empty list marks all of it.
+    bool submitFrame(const ofPixels& pixels, const std::vector<Rect>& dirtyRects);
+    bool submitFrame(StreamHandle stream, const ofPixels& pixels, const std::vector<Rect>& dirtyRects);
+    // Cursor metadata attached to every published buffer. A cursor change alone is sent
+    // even with setPublishOnlyOnChange, as a pointer-only buffer with empty chunks. Bitmaps are RGBA.
+    void setPublishCursor(const CursorInfo& cursor);
+    void setPublishCursor(StreamHandle stream, const CursorInfo& cursor);
+    void setPublishCursorBitmap(const ofPixels& bitmap);
+    void setPublishCursorBitmap(StreamHandle stream, const ofPixels& bitmap);
+    // Zero-copy publish: write into the returned buffer, then commit it.
+    // While in use, the process callback stops filling buffers from submitFrame.
+    PublishBuffer acquirePublishBuffer();
+    PublishBuffer acquirePublishBuffer(StreamHandle stream);
+    bool commitPublishBuffer(PublishBuffer& buffer);
 
     // Capture path (input stream)
+    // Convert and Hold: true whenever a frame has arrived, copying the newest one again if needed.
+    // Lazy: true only for a frame newer than the last one returned; otherwise outPixels is untouched.
     bool getLatestFrame(ofPixels& outPixels);
+    bool getLatestFrame(StreamHandle stream, ofPixels& outPixels);
+    // Newest captured frame without a copy; valid until the next capture call on this thread.
+    const ofPixels* getLatestFrameView();
+    const ofPixels* getLatestFrameView(StreamHandle stream);
+    // Capture only this part of the source's visible (cropped) area; frames come out at its size.
+    // A zero-sized rect captures the whole area again.
+    void setCaptureRegion(const Rect& region);
+    void setCaptureRegion(StreamHandle stream, const Rect& region);
+    // Timing of the frame the last getLatestFrame/getLatestFrameView call returned.
+    FrameTiming getLatestFrameTiming();
+    FrameTiming getLatestFrameTiming(StreamHandle stream);
+    // Pointer of the capture source, when it sends one as metadata. Pointer-only
+    // updates change these without producing a new frame.
+    CursorInfo getCursor();
+    CursorInfo getCursor(StreamHandle stream);
+    // Copies the pointer bitmap as RGBA; false when the source sent none.
+    bool getCursorBitmap(ofPixels& outPixels);
+    bool getCursorBitmap(StreamHandle stream, ofPixels& outPixels);
+    // Recording: keep up to depth frames in arrival order for popCapturedFrame() instead of
+    // only the newest one. Frames are preallocated; a depth of 0 goes back to getLatestFrame().
+    // Not available with CaptureMode::Hold.
+    void setCaptureQueue(int depth, QueuePolicy policy = QueuePolicy::DropOldest);
+    void setCaptureQueue(StreamHandle stream, int depth, QueuePolicy policy = QueuePolicy::DropOldest);
+    // Takes the oldest queued frame, waiting up to timeoutMillis for one when the queue is empty.
+    bool popCapturedFrame(ofPixels& outPixels, int timeoutMillis = 0);
+    bool popCapturedFrame(StreamHandle stream, ofPixels& outPixels, int timeoutMillis = 0);
+    bool popCapturedFrame(StreamHandle stream, ofPixels& outPixels, FrameTiming& outTiming, int timeoutMillis = 0);
+    // CaptureMode::Hold only: takes the newest buffer without converting it.
+    CapturedFrameView acquireCapturedFrame();
+    CapturedFrameView acquireCapturedFrame(StreamHandle stream);
+
+    // Audio publish path: queues interleaved frames and returns how many fit in the ring.
+    // The raw overload expects AudioConfig::channels channels.
+    size_t writeAudio(const ofSoundBuffer& buffer);
+    size_t writeAudio(const float* interleaved, size_t frames);
+
+    // Audio capture path: fills every frame, padding with silence, and returns how many were captured.
+    size_t readAudio(ofSoundBuffer& buffer);
+    size_t readAudio(float* interleaved, size_t frames);
+    size_t getAudioReadAvailable() const;
 
 private:
 #ifdef TARGET_LINUX
@@ -84,21 +428,375 @@ private:
         spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN;
         uint32_t stride = 0;
         bool valid = false;
+        bool negotiated = false;
+        ofxPipeWireConvert::PlaneLayout layout;
+        ofxPipeWireConvert::ColorMatrix matrix = ofxPipeWireConvert::ColorMatrix::BT601;
+        ofxPipeWireConvert::ColorRange range = ofxPipeWireConvert::ColorRange::Limited;
+        ofxPipeWireConvert::FrameConverter converter;
+    };
+
+    // Attached to pw_buffer::user_data by add_buffer.
+    struct BufferState {
+        static constexpr uint64_t unwritten = ~0ull;
+
+        NegotiatedVideo info;
+        ofxPipeWireConvert::ConstPlanes planes;
+        uint64_t sequence = 0;
+        uint64_t arrivalMicros = 0;
+        FrameTiming timing;
+        // Publish: generation of the frame this buffer holds, 0 for black.
+        uint64_t generation = unwritten;
     };
 
+    struct VideoStream;
+
     struct StreamListenerData {
         ofxPipeWire* self = nullptr;
         bool isPublish = false;
+        bool isAudio = false;
+        VideoStream* video = nullptr;
+    };
+
+    // Holds the thread loop lock for the current scope; no-op in main loop mode.
+    class LoopLock {
+    public:
+        explicit LoopLock(pw_thread_loop* loop) : loop(loop){
+            if(loop){
+                pw_thread_loop_lock(loop);
+            }
+        }
+        ~LoopLock(){
+            if(loop){
+                pw_thread_loop_unlock(loop);
+            }
+        }
+        LoopLock(const LoopLock&) = delete;
+        LoopLock& operator=(const LoopLock&) = delete;
+
+    private:
+        pw_thread_loop* loop = nullptr;
+    };
+
+    // Single-producer/single-consumer slot exchange over three buffers.
+    // The producer owns writeIndex(), the consumer owns readIndex(), and the
+    // third slot is swapped atomically between them.
+    class TripleBuffer {
+    public:
+        uint8_t writeIndex() const{
+            return write;
+        }
+        uint8_t readIndex() const{
+            return read;
+        }
+        // Returns true when the slot it replaced had not been read yet.
+        bool publish(){
+            uint8_t previous = middle.exchange(static_cast<uint8_t>(write | freshBit), std::memory_order_acq_rel);
+            write = previous & indexMask;
+            return (previous & freshBit) != 0;
+        }
+        bool acquire(){
+            if((middle.load(std::memory_order_acquire) & freshBit) == 0){
+                return false;
+            }
+            uint8_t previous = middle.exchange(read, std::memory_order_acq_rel);
+            read = previous & indexMask;
+            return true;
+        }
+        void reset(){
+            write = 0;
+            middle.store(1, std::memory_order_relaxed);
+            read = 2;
+        }
+
+    private:
+        static constexpr uint8_t indexMask = 0x3;
+        static constexpr uint8_t freshBit = 0x4;
+        uint8_t write = 0;
+        std::atomic<uint8_t> middle{1};
+        uint8_t read = 2;
+    };
+
+    // Single-producer/single-consumer ring of interleaved float frames. Storage is
+    // allocated by reset() before the streams run, so neither side allocates or blocks.
+    class AudioRing {
+    public:
+        void reset(size_t frames, int channels);
+        size_t write(const float* src, size_t frames);
+        size_t read(float* dst, size_t frames);
+        size_t getReadAvailable() const;
+        int getChannels() const{
+            return channels;
+        }
+
+    private:
+        std::vector<float> samples;
+        size_t capacity = 0;
+        int channels = 0;
+        std::atomic<size_t> writePos{0};
+        std::atomic<size_t> readPos{0};
+    };
+
+    // Written by param_changed, read by the realtime process callbacks.
+    struct AudioStreamState {
+        static constexpr uint32_t planarBit = 0x10000;
+        // Channel count plus planarBit for F32P, kept in one value so process never sees half an update.
+        std::atomic<uint32_t> layout{0};
+        std::atomic<uint32_t> rate{0};
+    };
+
+    static constexpr uint32_t maxAudioChannels = 64;
+
+    // Areas changed since the previous frame, bounded so the realtime path never allocates.
+    // Past maxRects they collapse into their bounding box. Rects are clipped and even-aligned.
+    struct Damage {
+        static constexpr int maxRects = 16;
+
+        std::array<Rect, maxRects> rects;
+        int count = 0;
+        bool full = true;
+
+        void setFull(){
+            full = true;
+            count = 0;
+        }
+        void clear(){
+            full = false;
+            count = 0;
+        }
+        void add(const Rect& rect);
+        void add(const Damage& other);
+        Rect getBounds() const;
+    };
+
+    static constexpr int damageHistory = 8;
+    using DamageHistory = std::array<Damage, damageHistory>;
+
+    // Frames converted by submitFrame (app thread) for the process callback to copy.
+    struct PublishSlot {
+        std::vector<uint8_t> data;
+        NegotiatedVideo info;
+        uint64_t generation = 0;
+        uint64_t submitMicros = 0;
+        // Damage of the latest generations as of this one, indexed by generation % damageHistory.
+        DamageHistory damage;
+    };
+
+    struct CaptureSlot {
+        ofPixels pixels;
+        std::vector<uint8_t> raw;
+        NegotiatedVideo info;
+        uint64_t sequence = 0;
+        uint64_t pixelsSequence = 0;
+        uint64_t arrivalMicros = 0;
+        FrameTiming timing;
+        // Loop thread only: what changed since these pixels were last converted.
+        Damage pendingDamage;
+        // Part of the source buffer these pixels came from.
+        Rect region;
+    };
+
+    // Frames waiting in arrival order. Only touched under the loop lock: process pushes,
+    // popCapturedFrame swaps the oldest into reading and converts or copies it after unlocking.
+    struct CaptureQueue {
+        std::vector<CaptureSlot> frames;
+        CaptureSlot reading;
+        size_t head = 0;
+        size_t count = 0;
+        QueuePolicy policy = QueuePolicy::DropOldest;
+
+        bool isEnabled() const{
+            return !frames.empty();
+        }
+        bool isFull() const{
+            return count == frames.size();
+        }
+    };
+
+    struct CursorSlot {
+        CursorInfo info;
+        // RGBA rows without padding.
+        std::vector<uint8_t> bitmap;
+        int bitmapWidth = 0;
+        int bitmapHeight = 0;
+    };
+
+    // Written with relaxed atomics by whichever thread sees the event, so neither the
+    // process callback nor getStats() ever waits.
+    struct StatsCounters {
+        std::atomic<uint64_t> framesProcessed{0};
+        std::atomic<uint64_t> framesDropped{0};
+        std::atomic<uint64_t> bufferUnderruns{0};
+        std::atomic<uint64_t> queuedFrames{0};
+        std::atomic<uint64_t> queueDropped{0};
+        std::atomic<uint64_t> lastConvertMicros{0};
+        std::atomic<uint64_t> totalConvertMicros{0};
+        std::atomic<uint64_t> convertCount{0};
+        std::array<std::atomic<uint64_t>, StreamStats::latencyBuckets> latency{};
+
+        void count(std::atomic<uint64_t>& counter, uint64_t amount = 1){
+            counter.fetch_add(amount, std::memory_order_relaxed);
+        }
+        void addConvertTime(uint64_t micros);
+        void addLatency(uint64_t micros);
+        StreamStats getSnapshot() const;
+    };
+
+    // One publish or capture pw_stream with everything its process callback touches.
+    // Owned through unique_ptr so the listener data keeps a stable address.
+    struct VideoStream {
+        StreamHandle handle = invalidStream;
+        bool isPublish = false;
+        VideoConfig config;
+        std::string name;
+        std::string targetObject;
+
+        pw_stream* stream = nullptr;
+        spa_hook listener;
+        StreamListenerData listenerData;
+        // Bumped on every reconnect so views of buffers from an earlier link are not queued back.
+        uint64_t connectGeneration = 0;
+        // Bumped by remove_buffer, so views of buffers PipeWire took back are not queued either.
+        // Only changed on the loop thread; read under the loop lock.
+        uint64_t bufferEpoch = 0;
+
+        // Driver mode: ticks are absolute times counted from an anchor, so they never drift.
+        spa_source* driverTimer = nullptr;
+        uint64_t driverStartNanos = 0;
+        uint64_t driverTicks = 0;
+        int driverFps = 0;
+        int driverFpsDenominator = 0;
+
+        // Publish: written by param_changed on the loop thread, read by submitFrame under publishMutex.
+        // Capture: only touched from the loop thread.
+        NegotiatedVideo info;
+
+        std::array<PublishSlot, 3> publishSlots;
+        TripleBuffer publishBuffers;
+        bool hasPublishFrame = false;
+        uint64_t publishGeneration = 0;
+        uint64_t publishQueuedGeneration = BufferState::unwritten;
+        // Header sequence of the buffers sent, from process or commitPublishBuffer.
+        std::atomic<uint64_t> publishSequence{0};
+        ofPixels publishScratch;
+        // Under publishMutex, like the publish slots' write side: damage per generation, and
+        // the layout it refers to.
+        DamageHistory publishDamage;
+        NegotiatedVideo publishDamageInfo;
+        std::mutex publishMutex;
+        std::atomic<bool> directPublish{false};
+        // The last submitted frame, so param_changed can convert it again for a new format
+        // instead of dropping it. Cleared by a zero-copy commit. Under publishMutex.
+        ofPixels lastSource;
+
+        std::array<CaptureSlot, 3> captureSlots;
+        TripleBuffer captureBuffers;
+        bool hasLatestFrame = false;
+        uint64_t captureDeliveredSequence = 0;
+        std::atomic<pw_buffer*> heldCaptureBuffer{nullptr};
+        uint64_t captureSequence = 0;
+        uint64_t lastHeaderSequence = 0;
+        bool hasHeaderSequence = false;
+        // App region of interest, relative to the source crop. Written under the loop lock.
+        Rect captureRegion;
+        CaptureQueue captureQueue;
+
+        // Capture: filled by process, read by getCursor. Publish: filled by setPublishCursor,
+        // read by process. cursorLatest belongs to the producer, hasCursor and cursorPending to the consumer.
+        std::array<CursorSlot, 3> cursorSlots;
+        TripleBuffer cursorBuffers;
+        CursorSlot cursorLatest;
+        bool hasCursor = false;
+        bool cursorPending = false;
+        // Publish: serial of the bitmap last attached to a buffer.
+        uint64_t cursorSentSerial = 0;
+
+        StatsCounters stats;
+    };
+
+    // One client stack (loop, context, core, registry) per loop mode, shared by every
+    // instance in the process and closed when the last one detaches.
+    struct Connection {
+        LoopMode loopMode = LoopMode::MainLoop;
+        int refCount = 0;
+        pw_main_loop* mainLoop = nullptr;
+        pw_thread_loop* threadLoop = nullptr;
+        pw_loop* loop = nullptr;
+        pw_context* context = nullptr;
+        pw_core* core = nullptr;
+        pw_registry* registry = nullptr;
+        spa_hook registryListener;
+
+        // Keyed by id and only touched on the loop thread. Registry callbacks signal
+        // discoveryEvent, which publishes one snapshot per batch of changes.
+        std::map<uint32_t, NodeInfo> nodes;
+        std::map<uint32_t, PortInfo> ports;
+        uint64_t discoveryGeneration = 0;
+        spa_source* discoveryEvent = nullptr;
+        bool discoveryPending = false;
+        // The mutex is only held to swap or copy the pointer.
+        std::shared_ptr<const DiscoverySnapshot> discovery;
+        mutable std::mutex discoveryMutex;
     };
 
+    static Connection* acquireConnection(LoopMode mode);
+    static void releaseConnection(Connection* connection);
+    static bool openConnection(Connection& connection);
+    static void closeConnection(Connection& connection);
+
     bool setupPipeWire();
     void teardownPipeWire();
 
-    bool createPublishStream();
-    bool createCaptureStream();
-
-    spa_pod* buildVideoFormat(spa_pod_builder& builder);
-    NegotiatedVideo getDefaultVideoInfo() const;
+    StreamHandle addVideoStream(bool isPublish, const std::string& target, const VideoConfig& config);
+    bool createVideoStream(VideoStream& stream);
+    bool connectVideoStream(VideoStream& stream);
+    bool retargetVideoStream(VideoStream& stream, const std::string& target);
+    bool renegotiateVideoStream(VideoStream& stream, const VideoConfig& config);
+    static bool isSameFormatRequest(const VideoConfig& a, const VideoConfig& b);
+    // Called with publishMutex held, from submitFrame or from param_changed.
+    void convertIntoSlot(VideoStream& stream, const ofPixels& pixels, const Damage& damage);
+    static bool isSameScheduling(const StreamTuning& a, const StreamTuning& b);
+    bool updateStreamScheduling(VideoStream& stream, const StreamTuning& tuning);
+    void destroyVideoStream(VideoStream& stream);
+    VideoStream* findStream(StreamHandle handle, bool isPublish) const;
+    VideoStream* findStream(StreamHandle handle) const;
+    bool createAudioStream(bool isPublish);
+
+    std::vector<spa_video_format> getOfferedFormats(const VideoStream& stream) const;
+    spa_pod* buildVideoFormat(spa_pod_builder& builder, const VideoStream& stream);
+    // Returns nullptr when there is nothing to ask for. blocks, size and stride of 0 are left out.
+    static spa_pod* buildBuffers(spa_pod_builder& builder, const StreamTuning& tuning, bool holdBuffers,
+                                 uint32_t blocks, uint32_t size, uint32_t stride);
+    static void applyStreamTuning(pw_properties* props, const StreamTuning& tuning, int defaultRate);
+    // node.latency and node.rate values, empty when the tuning leaves them to PipeWire.
+    static void getTuningProperties(const StreamTuning& tuning, int defaultRate, std::string& latency, std::string& rate);
+    static uint32_t alignStride(uint32_t stride, int align);
+    // Appends the metadata params streams negotiate and returns how many were added.
+    static uint32_t buildMetaParams(spa_pod_builder& builder, bool isPublish, const spa_pod** params);
+    spa_pod* buildAudioFormat(spa_pod_builder& builder);
+    NegotiatedVideo getDefaultVideoInfo(const VideoStream& stream) const;
+    static bool mapBufferPlanes(spa_buffer* buffer, const NegotiatedVideo& info, bool useChunks,
+                                ofxPipeWireConvert::Planes& planes);
+    static void writePublishChunks(spa_buffer* buffer, const ofxPipeWireConvert::PlaneLayout& layout);
+    static bool hasFrameData(spa_buffer* buffer);
+    static void readCaptureCursor(VideoStream& stream, spa_buffer* buffer);
+    static void writePublishCursor(VideoStream& stream, spa_buffer* buffer);
+    // Hands cursorLatest to the consumer; the bitmap is only copied into slots that lack it.
+    static void publishCursor(VideoStream& stream);
+    static void writePublishDamage(spa_buffer* buffer, const Damage& damage, int width, int height);
+    static Damage readCaptureDamage(spa_buffer* buffer, const NegotiatedVideo& info);
+    // Union of the damage after generation since up to generation; full when it is out of reach.
+    static Damage getDamageSince(const DamageHistory& history, uint64_t since, uint64_t generation);
+    // Clips to the frame and widens to even coordinates so chroma samples stay whole.
+    static bool alignRect(Rect& rect, int width, int height);
+    static bool intersectRect(Rect& rect, const Rect& bounds);
+    // The source crop narrowed by the app region, in buffer pixels.
+    Rect getCaptureRegion(const VideoStream& stream, spa_buffer* buffer) const;
+    static NegotiatedVideo getRegionInfo(const NegotiatedVideo& info, const Rect& region);
+    // Damage inside region, moved to region coordinates.
+    static Damage getRegionDamage(const Damage& damage, const Rect& region);
+    static bool isSameLayout(const NegotiatedVideo& a, const NegotiatedVideo& b);
+    static void writePublishHeader(VideoStream& stream, spa_buffer* buffer, uint64_t submitMicros, uint32_t flags);
+    static FrameTiming readCaptureHeader(VideoStream& stream, spa_buffer* buffer, uint64_t arrivalMicros);
 
     static void onRegistryGlobal(void* data, uint32_t id, uint32_t permissions,
                                  const char* type, uint32_t version, const spa_dict* props);
@@ -108,69 +806,125 @@ private:
                                      enum pw_stream_state state, const char* error);
 
     static void onStreamParamChanged(void* data, uint32_t id, const spa_pod* param);
+    static void onStreamAddBuffer(void* data, pw_buffer* buffer);
+    static void onStreamRemoveBuffer(void* data, pw_buffer* buffer);
+
+    static void onDriverTimer(void* data, uint64_t expirations);
+    // Arms the timer for the next tick; restart anchors the ticks at the current time.
+    void scheduleDriverTick(VideoStream& stream, bool restart);
 
     static void onPublishProcess(void* data);
     static void onCaptureProcess(void* data);
-
-    void handleCaptureBuffer(pw_buffer* buffer);
-    void fillPublishBuffer(pw_buffer* buffer);
-
-    void onVideoFormatChanged(bool isPublish, const spa_video_info_raw& info);
-
-    void ensurePublishFormat(const ofPixels& pixels, const NegotiatedVideo& info);
-    void convertToFormat(const ofPixels& src, uint8_t* dst, int dstStride, const NegotiatedVideo& info);
-    void convertFromFormat(const uint8_t* src, int srcStride, ofPixels& dst, const NegotiatedVideo& info);
-
-    void addNodeInfo(uint32_t id, const spa_dict* props);
-    void addPortInfo(uint32_t id, const spa_dict* props);
-    void removeObject(uint32_t id);
-    bool isVideoNode(const NodeInfo& node) const;
+    static void onAudioPublishProcess(void* data);
+    static void onAudioCaptureProcess(void* data);
+
+    void processCaptureBuffer(VideoStream& stream, pw_buffer* buffer, uint64_t arrivalMicros);
+    void handleCaptureBuffer(VideoStream& stream, pw_buffer* buffer, const FrameTiming& timing);
+    void fillCaptureSlot(VideoStream& stream, CaptureSlot& slot, const ofxPipeWireConvert::ConstPlanes& planes,
+                         const NegotiatedVideo& info, const Rect& region, const FrameTiming& timing);
+    // Picks the queue frame the next buffer goes into, or null when the policy drops it.
+    CaptureSlot* pushCaptureQueue(VideoStream& stream);
+    void allocateCaptureQueue(VideoStream& stream);
+    // Block policy: takes the buffers PipeWire kept while the queue was full.
+    void drainCaptureQueue(VideoStream& stream);
+    void holdCaptureBuffer(VideoStream& stream, pw_buffer* buffer, const FrameTiming& timing);
+    void releaseCapturedBuffer(StreamHandle handle, uint64_t connectGeneration, uint64_t bufferEpoch, pw_buffer* buffer);
+    static bool acquirePublishGeneration(VideoStream& stream, uint64_t& generation);
+    static void fillPublishBuffer(VideoStream& stream, pw_buffer* buffer, uint64_t generation);
+
+    void onVideoFormatChanged(VideoStream& stream, const spa_video_info_raw& info);
+    void onAudioFormatChanged(bool isPublish, const spa_audio_info_raw& info);
+
+    static bool mapAudioPlanes(spa_buffer* buffer, uint32_t layout, bool useChunks,
+                               float** planes, uint32_t& step, uint32_t& frames);
+    static size_t popAudio(AudioRing& ring, float* const* planes, uint32_t step, uint32_t channels,
+                           size_t frames, std::vector<float>& scratch);
+    static size_t pushAudio(AudioRing& ring, const float* const* planes, uint32_t step, uint32_t channels,
+                            size_t frames, std::vector<float>& scratch);
+
+    // With a partial damage only its rects are converted; the rest of dst is left as is.
+    void convertToFormat(const ofPixels& src, const ofxPipeWireConvert::Planes& dst, const NegotiatedVideo& info,
+                         ofPixels& scratch, const Damage* damage = nullptr);
+    void convertFromFormat(const ofxPipeWireConvert::ConstPlanes& src, ofPixels& dst, const NegotiatedVideo& info,
+                           const Damage* damage = nullptr);
+    void allocateCapturePixels(ofPixels& pixels, const NegotiatedVideo& info) const;
+    static ofxPipeWireConvert::PlaneLayout getPixelsLayout(spa_video_format format, int width, int height);
+
+    static void addNodeInfo(Connection& connection, uint32_t id, const spa_dict* props);
+    static void addPortInfo(Connection& connection, uint32_t id, const spa_dict* props);
+    static void removeObject(Connection& connection, uint32_t id);
+    static void markDiscoveryChanged(Connection& connection);
+    static void onDiscoveryEvent(void* data, uint64_t count);
+    static void publishDiscovery(Connection& connection);
+    static bool isVideoNode(const NodeInfo& node);
     static uint32_t parseUint32(const char* value);
+    static uint64_t getMonotonicMicros();
 
     static spa_video_format toSpaFormat(VideoFormatPreference format);
+    static spa_video_format toSpaFormat(ofPixelFormat format);
+
+    static std::mutex connectionMutex;
+    static Connection* sharedConnections[2];
 
+    LoopMode loopMode = LoopMode::MainLoop;
+    // Borrowed from the shared connection while set up.
+    Connection* connection = nullptr;
     pw_main_loop* mainLoop = nullptr;
-    pw_context* context = nullptr;
+    pw_thread_loop* threadLoop = nullptr;
+    pw_loop* loop = nullptr;
     pw_core* core = nullptr;
-    pw_registry* registry = nullptr;
 
-    pw_stream* publishStream = nullptr;
-    pw_stream* captureStream = nullptr;
-
-    spa_hook registryListener;
-    spa_hook publishListener;
-    spa_hook captureListener;
-
-    StreamListenerData publishListenerData;
-    StreamListenerData captureListenerData;
+    // Streams are added and removed from the app thread; callbacks only use their own entry.
+    std::vector<std::unique_ptr<VideoStream>> videoStreams;
+    StreamHandle nextStreamHandle = 1;
+    StreamHandle defaultPublishStream = invalidStream;
+    StreamHandle defaultCaptureStream = invalidStream;
 
     VideoConfig videoConfig;
-    bool publishEnabled = false;
-    bool captureEnabled = false;
 
     std::vector<VideoFormatPreference> preferredFormats;
 
-    NegotiatedVideo publishInfo;
-    NegotiatedVideo captureInfo;
-
-    std::vector<NodeInfo> nodes;
-    std::vector<PortInfo> ports;
-    mutable std::mutex discoveryMutex;
-
-    ofPixels publishFrame;
-    bool hasPublishFrame = false;
-    std::mutex publishMutex;
-
-    ofPixels latestFrame;
-    bool hasLatestFrame = false;
-    std::mutex captureMutex;
+    std::atomic<bool> publishOnlyOnChange{false};
+    // The loop thread reads the active values; the setters only change the pending ones,
+    // which setup() copies over before any stream exists.
+    CaptureMode captureMode = CaptureMode::Convert;
+    CaptureMode pendingCaptureMode = CaptureMode::Convert;
+    ofPixelFormat captureOutputFormat = OF_PIXELS_RGBA;
+    ofPixelFormat pendingCaptureOutputFormat = OF_PIXELS_RGBA;
+
+    pw_stream* audioPublishStream = nullptr;
+    pw_stream* audioCaptureStream = nullptr;
+    spa_hook audioPublishListener;
+    spa_hook audioCaptureListener;
+    StreamListenerData audioPublishListenerData;
+    StreamListenerData audioCaptureListenerData;
+
+    AudioConfig audioConfig;
+    bool audioPublishEnabled = false;
+    bool audioCaptureEnabled = false;
+    AudioRing audioPublishRing;
+    AudioRing audioCaptureRing;
+    AudioStreamState audioPublishState;
+    AudioStreamState audioCaptureState;
+    StatsCounters audioPublishStats;
+    StatsCounters audioCaptureStats;
+    // Channel remapping space, preallocated at setup: one per realtime callback and one per app-side call.
+    std::vector<float> audioPublishScratch;
+    std::vector<float> audioCaptureScratch;
+    std::vector<float> audioWriteScratch;
+    std::vector<float> audioReadScratch;
 
     std::string appName = "ofxPipeWire";
     std::string nodeName = "ofxPipeWire";
 
     std::string publishTargetObject;
     std::string captureTargetObject;
+    Rect captureRegion;
+    int captureQueueDepth = 0;
+    QueuePolicy captureQueuePolicy = QueuePolicy::DropOldest;
 #endif
 
     bool initialized = false;
+    // Captured frame views hold this weakly; it goes away first in the destructor.
+    std::shared_ptr<ofxPipeWire*> liveness = std::make_shared<ofxPipeWire*>(this);
 };
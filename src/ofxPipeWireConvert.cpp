@@ -0,0 +1,1209 @@
+#include "ofxPipeWireConvert.h"
+
+#ifdef TARGET_LINUX
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OFX_PIPEWIRE_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OFX_PIPEWIRE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace ofxPipeWireConvert {
+
+namespace {
+
+enum class Kernel {
+    Scalar,
+    Ssse3,
+    Avx2,
+    Neon
+};
+
+Kernel detectKernel(){
+#if defined(OFX_PIPEWIRE_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return Kernel::Avx2;
+    }
+    if(__builtin_cpu_supports("ssse3")){
+        return Kernel::Ssse3;
+    }
+#elif defined(OFX_PIPEWIRE_NEON)
+    return Kernel::Neon;
+#endif
+    return Kernel::Scalar;
+}
+
+Kernel getKernel(){
+    static const Kernel kernel = detectKernel();
+    return kernel;
+}
+
+void copyRow(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    memcpy(dst, src, static_cast<size_t>(width) * converter.dstBytesPerPixel);
+}
+
+// Reference kernel; the vector kernels must match it bit for bit.
+void convertScalar(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const int srcBytes = converter.srcBytesPerPixel;
+    const int dstBytes = converter.dstBytesPerPixel;
+    for(int x = 0; x < width; ++x){
+        for(int i = 0; i < dstBytes; ++i){
+            const uint8_t index = converter.map[i];
+            dst[i] = index == RowConverter::fillByte ? 255 : src[index];
+        }
+        src += srcBytes;
+        dst += dstBytes;
+    }
+}
+
+// Luma from packed RGB with full-range BT.601 weights; map[0..2] hold the source R, G and B offsets.
+void convertToGrayScalar(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const int srcBytes = converter.srcBytesPerPixel;
+    const uint8_t r = converter.map[0];
+    const uint8_t g = converter.map[1];
+    const uint8_t b = converter.map[2];
+    for(int x = 0; x < width; ++x){
+        dst[x] = static_cast<uint8_t>((77 * src[r] + 150 * src[g] + 29 * src[b] + 128) >> 8);
+        src += srcBytes;
+    }
+}
+
+#if defined(OFX_PIPEWIRE_X86)
+__attribute__((target("ssse3")))
+void convertSsse3(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.shuffle));
+    const __m128i fill = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.fill));
+
+    int x = 0;
+    for(; x + 4 <= width; x += 4){
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), fill);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), pixels);
+    }
+    convertScalar(src + x * 4, dst + x * 4, width - x, converter);
+}
+
+__attribute__((target("avx2")))
+void convertAvx2(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    // vpshufb works per 128-bit lane, so the 16-byte pattern is broadcast to both lanes.
+    const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(converter.shuffle)));
+    const __m256i fill = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(converter.fill)));
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8){
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * 4));
+        pixels = _mm256_or_si256(_mm256_shuffle_epi8(pixels, shuffle), fill);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), pixels);
+    }
+    convertScalar(src + x * 4, dst + x * 4, width - x, converter);
+}
+
+// Expands or packs between 1, 3 and 4 bytes per pixel, four pixels per shuffle.
+// Loads and stores are a full register wide, so the loop stops while both stay inside the row.
+__attribute__((target("ssse3")))
+void convertResizeSsse3(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.shuffle));
+    const __m128i fill = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.fill));
+    const int srcBytes = converter.srcBytesPerPixel;
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int reach = std::max((16 + srcBytes - 1) / srcBytes, (16 + dstBytes - 1) / dstBytes);
+
+    int x = 0;
+    for(; x + reach <= width; x += 4){
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * srcBytes));
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), fill);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * dstBytes), pixels);
+    }
+    convertScalar(src + x * srcBytes, dst + x * dstBytes, width - x, converter);
+}
+
+__attribute__((target("avx2")))
+void convertResizeAvx2(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(converter.shuffle)));
+    const __m256i fill = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(converter.fill)));
+    const int srcBytes = converter.srcBytesPerPixel;
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int reach = std::max((32 + srcBytes - 1) / srcBytes, (32 + dstBytes - 1) / dstBytes);
+
+    // Move pixel 4 to the start of the upper lane, and close the gap between the
+    // two 12-byte halves again when writing 3-byte pixels.
+    const __m256i spread = srcBytes == 4 ? _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7) :
+                           srcBytes == 3 ? _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6) :
+                                           _mm256_setr_epi32(0, 1, 2, 3, 1, 2, 3, 4);
+    const __m256i pack = dstBytes == 3 ? _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7) :
+                                         _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    int x = 0;
+    for(; x + reach <= width; x += 8){
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * srcBytes));
+        pixels = _mm256_permutevar8x32_epi32(pixels, spread);
+        pixels = _mm256_or_si256(_mm256_shuffle_epi8(pixels, shuffle), fill);
+        pixels = _mm256_permutevar8x32_epi32(pixels, pack);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * dstBytes), pixels);
+    }
+    convertScalar(src + x * srcBytes, dst + x * dstBytes, width - x, converter);
+}
+#endif
+
+#if defined(OFX_PIPEWIRE_NEON)
+// De-interleaving loads handle every 1-, 3- and 4-byte combination, 16 pixels at a time.
+void convertNeon(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter){
+    const uint8x16_t opaque = vdupq_n_u8(255);
+    const int srcBytes = converter.srcBytesPerPixel;
+    const int dstBytes = converter.dstBytesPerPixel;
+
+    int x = 0;
+    for(; x + 16 <= width; x += 16){
+        uint8x16_t in[4] = {opaque, opaque, opaque, opaque};
+        if(srcBytes == 4){
+            uint8x16x4_t planes = vld4q_u8(src + x * 4);
+            for(int i = 0; i < 4; ++i){
+                in[i] = planes.val[i];
+            }
+        }else if(srcBytes == 3){
+            uint8x16x3_t planes = vld3q_u8(src + x * 3);
+            for(int i = 0; i < 3; ++i){
+                in[i] = planes.val[i];
+            }
+        }else{
+            in[0] = vld1q_u8(src + x);
+        }
+
+        uint8x16_t out[4];
+        for(int i = 0; i < dstBytes; ++i){
+            const uint8_t index = converter.map[i];
+            out[i] = index == RowConverter::fillByte ? opaque : in[index];
+        }
+
+        if(dstBytes == 4){
+            uint8x16x4_t planes = {{out[0], out[1], out[2], out[3]}};
+            vst4q_u8(dst + x * 4, planes);
+        }else{
+            uint8x16x3_t planes = {{out[0], out[1], out[2]}};
+            vst3q_u8(dst + x * 3, planes);
+        }
+    }
+    convertScalar(src + x * srcBytes, dst + x * dstBytes, width - x, converter);
+}
+#endif
+
+inline uint8_t clampByte(int value){
+    return static_cast<uint8_t>(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// Reference YUV kernel; the vector kernels must match it bit for bit.
+// Writes 3- or 4-byte pixels; a 4th byte is always 255.
+void yuvToPackedScalar(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter){
+    const YuvCoefficients& k = converter.coefficients;
+    const YuvComponent& cy = converter.components[0];
+    const YuvComponent& cu = converter.components[1];
+    const YuvComponent& cv = converter.components[2];
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int alpha = 6 - converter.r - converter.g - converter.b;
+
+    for(int x = 0; x < width; ++x){
+        const int y = (rows[0][cy.offset + x * cy.step] - k.yOffset) * k.y;
+        const int u = rows[1][cu.offset + (x >> 1) * cu.step] - 128;
+        const int v = rows[2][cv.offset + (x >> 1) * cv.step] - 128;
+
+        uint8_t* pixel = dst + x * dstBytes;
+        pixel[converter.r] = clampByte((y + k.rv * v + 128) >> 8);
+        pixel[converter.g] = clampByte((y - k.gu * u - k.gv * v + 128) >> 8);
+        pixel[converter.b] = clampByte((y + k.bu * u + 128) >> 8);
+        if(dstBytes == 4){
+            pixel[alpha] = 255;
+        }
+    }
+}
+
+// Luma only, rescaled to full range.
+void yuvToGrayScalar(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter){
+    const YuvCoefficients& k = converter.coefficients;
+    const YuvComponent& cy = converter.components[0];
+    if(cy.step == 1 && k.yOffset == 0 && k.y == 256){
+        memcpy(dst, rows[0] + cy.offset, static_cast<size_t>(width));
+        return;
+    }
+    for(int x = 0; x < width; ++x){
+        dst[x] = clampByte(((rows[0][cy.offset + x * cy.step] - k.yOffset) * k.y + 128) >> 8);
+    }
+}
+
+// Finishes a row with the scalar kernel from pixel x (always even) onwards.
+void yuvToPackedTail(const uint8_t* const rows[3], uint8_t* dst, int x, int width, const YuvConverter& converter){
+    if(x >= width){
+        return;
+    }
+
+    const uint8_t* tail[3];
+    for(int i = 0; i < 3; ++i){
+        const YuvComponent& component = converter.components[i];
+        tail[i] = rows[i] + (i == 0 ? x : (x >> 1)) * component.step;
+    }
+    yuvToPackedScalar(tail, dst + x * converter.dstBytesPerPixel, width - x, converter);
+}
+
+#if defined(OFX_PIPEWIRE_X86)
+inline __m128i loadBlock(const uint8_t* src, int bytes){
+    if(bytes >= 16){
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    }
+    if(bytes >= 8){
+        return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+    }
+    int32_t value;
+    memcpy(&value, src, sizeof(value));
+    return _mm_cvtsi32_si128(value);
+}
+
+__attribute__((target("avx2")))
+void yuvToPackedAvx2(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter){
+    const YuvCoefficients& k = converter.coefficients;
+    const __m128i gatherY = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[0]));
+    const __m128i gatherU = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[1]));
+    const __m128i gatherV = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[2]));
+    const __m256i yOffset = _mm256_set1_epi32(k.yOffset);
+    const __m256i yScale = _mm256_set1_epi32(k.y);
+    const __m256i rv = _mm256_set1_epi32(k.rv);
+    const __m256i gu = _mm256_set1_epi32(k.gu);
+    const __m256i gv = _mm256_set1_epi32(k.gv);
+    const __m256i bu = _mm256_set1_epi32(k.bu);
+    const __m256i bias = _mm256_set1_epi32(128);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i maxValue = _mm256_set1_epi32(255);
+    const __m128i rShift = _mm_cvtsi32_si128(converter.r * 8);
+    const __m128i gShift = _mm_cvtsi32_si128(converter.g * 8);
+    const __m128i bShift = _mm_cvtsi32_si128(converter.b * 8);
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFFu << ((6 - converter.r - converter.g - converter.b) * 8)));
+
+    // 3-byte output drops every 4th byte per lane, then closes the gap between lanes.
+    // The 32-byte store runs 8 bytes past the pixels, so the loop stops earlier.
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int reach = dstBytes == 3 ? 11 : 8;
+    const __m256i dropAlpha = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128,
+                                               0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    int x = 0;
+    for(; x + reach <= width; x += 8){
+        const int block = x >> 3;
+        __m256i y = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(loadBlock(rows[0] + block * converter.advance[0], converter.advance[0]), gatherY));
+        __m256i u = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(loadBlock(rows[1] + block * converter.advance[1], converter.advance[1]), gatherU));
+        __m256i v = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(loadBlock(rows[2] + block * converter.advance[2], converter.advance[2]), gatherV));
+
+        y = _mm256_mullo_epi32(_mm256_sub_epi32(y, yOffset), yScale);
+        u = _mm256_sub_epi32(u, bias);
+        v = _mm256_sub_epi32(v, bias);
+
+        __m256i r = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(y, _mm256_mullo_epi32(v, rv)), bias), 8);
+        __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(y, bias), _mm256_mullo_epi32(u, gu)), _mm256_mullo_epi32(v, gv)), 8);
+        __m256i b = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(y, _mm256_mullo_epi32(u, bu)), bias), 8);
+        r = _mm256_min_epi32(_mm256_max_epi32(r, zero), maxValue);
+        g = _mm256_min_epi32(_mm256_max_epi32(g, zero), maxValue);
+        b = _mm256_min_epi32(_mm256_max_epi32(b, zero), maxValue);
+
+        __m256i pixels = _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(r, rShift), _mm256_sll_epi32(g, gShift)),
+                                         _mm256_or_si256(_mm256_sll_epi32(b, bShift), alpha));
+        if(dstBytes == 3){
+            pixels = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, dropAlpha), pack);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * dstBytes), pixels);
+    }
+    yuvToPackedTail(rows, dst, x, width, converter);
+}
+
+// Two 16-bit factors per 32-bit lane, for _mm_madd_epi16 against interleaved (lo, hi) samples.
+inline __m128i setFactorPair(int lo, int hi){
+    return _mm_set1_epi32(static_cast<int>((static_cast<uint32_t>(hi) << 16) | (static_cast<uint32_t>(lo) & 0xFFFFu)));
+}
+
+// (y + pair products + 128) >> 8 for eight pixels, clamped to bytes in the low half.
+inline __m128i yuvChannel(__m128i yLo, __m128i yHi, __m128i uvLo, __m128i uvHi, __m128i factors){
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(yLo, _mm_madd_epi16(uvLo, factors)), bias), 8);
+    const __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(yHi, _mm_madd_epi16(uvHi, factors)), bias), 8);
+    return _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+}
+
+// All inputs fit 16 bits, so the products are formed with pmaddwd in 32 bits and match
+// the scalar kernel exactly without needing SSE4.1 32-bit multiplies.
+__attribute__((target("ssse3")))
+void yuvToPackedSsse3(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter){
+    const YuvCoefficients& k = converter.coefficients;
+    const __m128i gatherY = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[0]));
+    const __m128i gatherU = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[1]));
+    const __m128i gatherV = _mm_load_si128(reinterpret_cast<const __m128i*>(converter.gather[2]));
+    const __m128i yOffset = _mm_set1_epi16(static_cast<int16_t>(k.yOffset));
+    const __m128i chromaBias = _mm_set1_epi16(128);
+    const __m128i yScale = setFactorPair(k.y, 0);
+    const __m128i rFactors = setFactorPair(0, k.rv);
+    const __m128i gFactors = setFactorPair(-k.gu, -k.gv);
+    const __m128i bFactors = setFactorPair(k.bu, 0);
+    const __m128i zero = _mm_setzero_si128();
+
+    // 3-byte output is written as two 16-byte stores 12 bytes apart, which run 4 bytes past the pixels.
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int alpha = 6 - converter.r - converter.g - converter.b;
+    const int reach = dstBytes == 3 ? 10 : 8;
+    const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128);
+
+    int x = 0;
+    for(; x + reach <= width; x += 8){
+        const int block = x >> 3;
+        __m128i y = _mm_unpacklo_epi8(_mm_shuffle_epi8(loadBlock(rows[0] + block * converter.advance[0], converter.advance[0]), gatherY), zero);
+        __m128i u = _mm_unpacklo_epi8(_mm_shuffle_epi8(loadBlock(rows[1] + block * converter.advance[1], converter.advance[1]), gatherU), zero);
+        __m128i v = _mm_unpacklo_epi8(_mm_shuffle_epi8(loadBlock(rows[2] + block * converter.advance[2], converter.advance[2]), gatherV), zero);
+        y = _mm_sub_epi16(y, yOffset);
+        u = _mm_sub_epi16(u, chromaBias);
+        v = _mm_sub_epi16(v, chromaBias);
+
+        const __m128i yLo = _mm_madd_epi16(_mm_unpacklo_epi16(y, zero), yScale);
+        const __m128i yHi = _mm_madd_epi16(_mm_unpackhi_epi16(y, zero), yScale);
+        const __m128i uvLo = _mm_unpacklo_epi16(u, v);
+        const __m128i uvHi = _mm_unpackhi_epi16(u, v);
+
+        __m128i channels[4];
+        channels[converter.r] = yuvChannel(yLo, yHi, uvLo, uvHi, rFactors);
+        channels[converter.g] = yuvChannel(yLo, yHi, uvLo, uvHi, gFactors);
+        channels[converter.b] = yuvChannel(yLo, yHi, uvLo, uvHi, bFactors);
+        channels[alpha] = _mm_set1_epi8(-1);
+
+        const __m128i low = _mm_unpacklo_epi8(channels[0], channels[1]);
+        const __m128i high = _mm_unpacklo_epi8(channels[2], channels[3]);
+        __m128i first = _mm_unpacklo_epi16(low, high);
+        __m128i second = _mm_unpackhi_epi16(low, high);
+        if(dstBytes == 3){
+            first = _mm_shuffle_epi8(first, dropAlpha);
+            second = _mm_shuffle_epi8(second, dropAlpha);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * dstBytes), first);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * dstBytes + dstBytes * 4), second);
+    }
+    yuvToPackedTail(rows, dst, x, width, converter);
+}
+#endif
+
+#if defined(OFX_PIPEWIRE_NEON)
+inline uint8x16_t loadBlockNeon(const uint8_t* src, int bytes){
+    if(bytes >= 16){
+        return vld1q_u8(src);
+    }
+    if(bytes >= 8){
+        return vcombine_u8(vld1_u8(src), vdup_n_u8(0));
+    }
+    uint8_t block[16] = {};
+    memcpy(block, src, 4);
+    return vld1q_u8(block);
+}
+
+inline uint8x8_t gatherNeon(uint8x16_t block, const uint8_t* pattern){
+#if defined(__aarch64__)
+    return vqtbl1_u8(block, vld1_u8(pattern));
+#else
+    uint8x8x2_t table = {{vget_low_u8(block), vget_high_u8(block)}};
+    return vtbl2_u8(table, vld1_u8(pattern));
+#endif
+}
+
+inline int32x4_t clampNeon(int32x4_t value){
+    return vminq_s32(vmaxq_s32(value, vdupq_n_s32(0)), vdupq_n_s32(255));
+}
+
+// Computes R, G and B for four pixels.
+inline void yuvToRgbNeon(int32x4_t y, int32x4_t u, int32x4_t v, const YuvCoefficients& k, int32x4_t rgb[3]){
+    const int32x4_t bias = vdupq_n_s32(128);
+
+    y = vmulq_n_s32(vsubq_s32(y, vdupq_n_s32(k.yOffset)), k.y);
+    u = vsubq_s32(u, bias);
+    v = vsubq_s32(v, bias);
+
+    rgb[0] = clampNeon(vshrq_n_s32(vaddq_s32(vmlaq_n_s32(y, v, k.rv), bias), 8));
+    rgb[1] = clampNeon(vshrq_n_s32(vmlsq_n_s32(vmlsq_n_s32(vaddq_s32(y, bias), u, k.gu), v, k.gv), 8));
+    rgb[2] = clampNeon(vshrq_n_s32(vaddq_s32(vmlaq_n_s32(y, u, k.bu), bias), 8));
+}
+
+inline uint8x8_t narrowNeon(int32x4_t lo, int32x4_t hi){
+    return vmovn_u16(vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(lo)), vmovn_u32(vreinterpretq_u32_s32(hi))));
+}
+
+void yuvToPackedNeon(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter){
+    const int dstBytes = converter.dstBytesPerPixel;
+    const int alpha = 6 - converter.r - converter.g - converter.b;
+
+    int x = 0;
+    for(; x + 8 <= width; x += 8){
+        const int block = x >> 3;
+        int32x4_t lo[3];
+        int32x4_t hi[3];
+        for(int i = 0; i < 3; ++i){
+            uint8x8_t samples = gatherNeon(loadBlockNeon(rows[i] + block * converter.advance[i], converter.advance[i]), converter.gather[i]);
+            uint16x8_t wide = vmovl_u8(samples);
+            lo[i] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(wide)));
+            hi[i] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(wide)));
+        }
+
+        int32x4_t rgbLo[3];
+        int32x4_t rgbHi[3];
+        yuvToRgbNeon(lo[0], lo[1], lo[2], converter.coefficients, rgbLo);
+        yuvToRgbNeon(hi[0], hi[1], hi[2], converter.coefficients, rgbHi);
+
+        uint8x8_t channels[4];
+        channels[converter.r] = narrowNeon(rgbLo[0], rgbHi[0]);
+        channels[converter.g] = narrowNeon(rgbLo[1], rgbHi[1]);
+        channels[converter.b] = narrowNeon(rgbLo[2], rgbHi[2]);
+        if(dstBytes == 4){
+            channels[alpha] = vdup_n_u8(255);
+            uint8x8x4_t out = {{channels[0], channels[1], channels[2], channels[3]}};
+            vst4_u8(dst + x * 4, out);
+        }else{
+            uint8x8x3_t out = {{channels[0], channels[1], channels[2]}};
+            vst3_u8(dst + x * 3, out);
+        }
+    }
+    yuvToPackedTail(rows, dst, x, width, converter);
+}
+#endif
+
+YuvConverter::Function selectYuvToPacked(int dstBytesPerPixel){
+    if(dstBytesPerPixel == 1){
+        return yuvToGrayScalar;
+    }
+
+    switch(getKernel()){
+#if defined(OFX_PIPEWIRE_X86)
+        case Kernel::Avx2:
+            return yuvToPackedAvx2;
+        case Kernel::Ssse3:
+            return yuvToPackedSsse3;
+#endif
+#if defined(OFX_PIPEWIRE_NEON)
+        case Kernel::Neon:
+            return yuvToPackedNeon;
+#endif
+        default:
+            return yuvToPackedScalar;
+    }
+}
+
+// Integer RGB to YUV weights scaled by 256.
+struct RgbToYuvCoefficients {
+    int yOffset;
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+};
+
+RgbToYuvCoefficients getRgbToYuvCoefficients(ColorMatrix matrix, ColorRange range){
+    if(range == ColorRange::Full){
+        if(matrix == ColorMatrix::BT709){
+            return {0, 54, 183, 18, -29, -99, 128, 128, -116, -12};
+        }
+        return {0, 77, 150, 29, -43, -85, 128, 128, -107, -21};
+    }
+    if(matrix == ColorMatrix::BT709){
+        return {16, 47, 157, 16, -26, -87, 112, 112, -102, -10};
+    }
+    return {16, 66, 129, 25, -38, -74, 112, 112, -94, -18};
+}
+
+YuvCoefficients getYuvCoefficients(ColorMatrix matrix, ColorRange range){
+    if(range == ColorRange::Full){
+        if(matrix == ColorMatrix::BT709){
+            return {0, 256, 403, 48, 120, 475};
+        }
+        return {0, 256, 359, 88, 183, 454};
+    }
+    if(matrix == ColorMatrix::BT709){
+        return {16, 298, 459, 55, 136, 541};
+    }
+    return {16, 298, 409, 100, 208, 516};
+}
+
+bool getYuvComponents(spa_video_format format, YuvComponent components[3], int& chromaRowShift){
+    switch(format){
+        case SPA_VIDEO_FORMAT_NV12:
+            components[0] = {0, 0, 1};
+            components[1] = {1, 0, 2};
+            components[2] = {1, 1, 2};
+            chromaRowShift = 1;
+            return true;
+        case SPA_VIDEO_FORMAT_I420:
+            components[0] = {0, 0, 1};
+            components[1] = {1, 0, 1};
+            components[2] = {2, 0, 1};
+            chromaRowShift = 1;
+            return true;
+        case SPA_VIDEO_FORMAT_YUY2:
+            components[0] = {0, 0, 2};
+            components[1] = {0, 1, 4};
+            components[2] = {0, 3, 4};
+            chromaRowShift = 0;
+            return true;
+        case SPA_VIDEO_FORMAT_UYVY:
+            components[0] = {0, 1, 2};
+            components[1] = {0, 0, 4};
+            components[2] = {0, 2, 4};
+            chromaRowShift = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+#if defined(OFX_PIPEWIRE_X86)
+// Spreads R, G and B of eight 3- or 4-byte pixels into 16-bit lanes.
+struct RgbGather {
+    __m128i rg;
+    __m128i b;
+    int bytes;
+};
+
+RgbGather getRgbGather(const PackedLayout& in){
+    alignas(16) int8_t rg[16];
+    alignas(16) int8_t b[16];
+    for(int i = 0; i < 4; ++i){
+        rg[i * 2] = static_cast<int8_t>(i * in.bytesPerPixel + in.r);
+        rg[i * 2 + 8] = static_cast<int8_t>(i * in.bytesPerPixel + in.g);
+        b[i * 2] = static_cast<int8_t>(i * in.bytesPerPixel + in.b);
+        rg[i * 2 + 1] = rg[i * 2 + 9] = b[i * 2 + 1] = -128;
+        b[i * 2 + 8] = b[i * 2 + 9] = -128;
+    }
+    return {_mm_load_si128(reinterpret_cast<const __m128i*>(rg)), _mm_load_si128(reinterpret_cast<const __m128i*>(b)), in.bytesPerPixel};
+}
+
+__attribute__((target("ssse3")))
+inline void loadRgbSsse3(const uint8_t* src, const RgbGather& gather, __m128i& r, __m128i& g, __m128i& b){
+    const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + gather.bytes * 4));
+    const __m128i rgFirst = _mm_shuffle_epi8(first, gather.rg);
+    const __m128i rgSecond = _mm_shuffle_epi8(second, gather.rg);
+    r = _mm_unpacklo_epi64(rgFirst, rgSecond);
+    g = _mm_unpackhi_epi64(rgFirst, rgSecond);
+    b = _mm_unpacklo_epi64(_mm_shuffle_epi8(first, gather.b), _mm_shuffle_epi8(second, gather.b));
+}
+
+inline void storeSamples(__m128i samples, int count, uint8_t* dst, const YuvComponent& component){
+    alignas(16) uint8_t values[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(values), samples);
+    if(component.step == 1){
+        memcpy(dst + component.offset, values, static_cast<size_t>(count));
+        return;
+    }
+    for(int i = 0; i < count; ++i){
+        dst[component.offset + i * component.step] = values[i];
+    }
+}
+
+// Vector part of packedToYuv for a group of rowCount rows sharing one chroma row.
+// Uses the same integer maths as the scalar loop, with every product pair formed by
+// pmaddwd, and returns the first pixel (a multiple of 8) left for the scalar loop.
+__attribute__((target("ssse3")))
+int packedToYuvSsse3(const uint8_t* const srcRows[2], uint8_t* const lumaRows[2], uint8_t* uRow, uint8_t* vRow,
+                     int rowCount, int width, const RgbGather& gather, const YuvComponent components[3],
+                     const RgbToYuvCoefficients& k){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i yOffset = _mm_set1_epi32(k.yOffset);
+    const __m128i yRg = setFactorPair(k.yr, k.yg);
+    const __m128i yB = setFactorPair(k.yb, 0);
+    const __m128i uRg = setFactorPair(k.ur, k.ug);
+    const __m128i uB = setFactorPair(k.ub, 0);
+    const __m128i vRg = setFactorPair(k.vr, k.vg);
+    const __m128i vB = setFactorPair(k.vb, 0);
+    // Averages over 2 * rowCount pixels, rounded like (sum + count / 2) / count.
+    const __m128i half = _mm_set1_epi32(rowCount);
+    const __m128i shift = _mm_cvtsi32_si128(rowCount);
+    // A 16-byte load at pixel 4 reaches 4 bytes past pixel 8 with 3-byte pixels.
+    const int reach = gather.bytes == 3 ? 10 : 8;
+
+    int x = 0;
+    for(; x + reach <= width; x += 8){
+        __m128i rSum = zero;
+        __m128i gSum = zero;
+        __m128i bSum = zero;
+        for(int row = 0; row < rowCount; ++row){
+            __m128i r, g, b;
+            loadRgbSsse3(srcRows[row] + x * gather.bytes, gather, r, g, b);
+
+            const __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), yRg), _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), yB));
+            const __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), yRg), _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), yB));
+            const __m128i lumaLo = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(lo, bias), 8), yOffset);
+            const __m128i lumaHi = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(hi, bias), 8), yOffset);
+            storeSamples(_mm_packus_epi16(_mm_packs_epi32(lumaLo, lumaHi), zero), 8, lumaRows[row] + x * components[0].step, components[0]);
+
+            rSum = _mm_add_epi32(rSum, _mm_madd_epi16(r, ones));
+            gSum = _mm_add_epi32(gSum, _mm_madd_epi16(g, ones));
+            bSum = _mm_add_epi32(bSum, _mm_madd_epi16(b, ones));
+        }
+
+        const __m128i r = _mm_sra_epi32(_mm_add_epi32(rSum, half), shift);
+        const __m128i g = _mm_sra_epi32(_mm_add_epi32(gSum, half), shift);
+        const __m128i b = _mm_sra_epi32(_mm_add_epi32(bSum, half), shift);
+        // Averages fit 16 bits, so R and G pair up in one lane.
+        const __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+        const __m128i u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg, uRg), _mm_madd_epi16(b, uB)), bias), 8), bias);
+        const __m128i v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg, vRg), _mm_madd_epi16(b, vB)), bias), 8), bias);
+        const int cx = x >> 1;
+        storeSamples(_mm_packus_epi16(_mm_packs_epi32(u, zero), zero), 4, uRow + cx * components[1].step, components[1]);
+        storeSamples(_mm_packus_epi16(_mm_packs_epi32(v, zero), zero), 4, vRow + cx * components[2].step, components[2]);
+    }
+    return x;
+}
+#endif
+
+// Chroma is averaged over each 2x1 (4:2:2) or 2x2 (4:2:0) block.
+void packedToYuv(const ConstPlanes& src, const Planes& dst, int width, int height, const PackedLayout& in,
+                 spa_video_format format, ColorMatrix matrix, ColorRange range){
+    YuvComponent components[3];
+    int chromaRowShift = 0;
+    if(!getYuvComponents(format, components, chromaRowShift)){
+        return;
+    }
+
+    const RgbToYuvCoefficients k = getRgbToYuvCoefficients(matrix, range);
+    const int bytes = in.bytesPerPixel;
+    const YuvComponent& cy = components[0];
+    const YuvComponent& cu = components[1];
+    const YuvComponent& cv = components[2];
+    const int rowsPerChroma = 1 << chromaRowShift;
+
+#if defined(OFX_PIPEWIRE_X86)
+    // The AVX2 tier reuses the SSSE3 kernel here.
+    const bool vector = bytes >= 3 && getKernel() != Kernel::Scalar;
+    const RgbGather gather = vector ? getRgbGather(in) : RgbGather{};
+#endif
+
+    for(int y = 0; y < height; y += rowsPerChroma){
+        const int rowCount = std::min(rowsPerChroma, height - y);
+        const int chromaRow = y >> chromaRowShift;
+        uint8_t* uRow = dst.data[cu.plane] + (cu.plane == 0 ? y : chromaRow) * dst.stride[cu.plane];
+        uint8_t* vRow = dst.data[cv.plane] + (cv.plane == 0 ? y : chromaRow) * dst.stride[cv.plane];
+        const uint8_t* srcRows[2];
+        uint8_t* lumaRows[2];
+        for(int i = 0; i < rowCount; ++i){
+            const int row = y + i;
+            srcRows[i] = src.data[0] + row * src.stride[0];
+            lumaRows[i] = dst.data[cy.plane] + (cy.plane == 0 ? row : (row >> chromaRowShift)) * dst.stride[cy.plane];
+        }
+
+        int start = 0;
+#if defined(OFX_PIPEWIRE_X86)
+        if(vector){
+            start = packedToYuvSsse3(srcRows, lumaRows, uRow, vRow, rowCount, width, gather, components, k);
+        }
+#endif
+
+        for(int i = 0; i < rowCount; ++i){
+            for(int x = start; x < width; ++x){
+                const uint8_t* pixel = srcRows[i] + x * bytes;
+                const int luma = ((k.yr * pixel[in.r] + k.yg * pixel[in.g] + k.yb * pixel[in.b] + 128) >> 8) + k.yOffset;
+                lumaRows[i][cy.offset + x * cy.step] = clampByte(luma);
+            }
+        }
+
+        for(int cx = start / 2; cx < (width + 1) / 2; ++cx){
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            int count = 0;
+            for(int i = 0; i < rowCount; ++i){
+                for(int x = cx * 2; x < std::min(cx * 2 + 2, width); ++x){
+                    const uint8_t* pixel = srcRows[i] + x * bytes;
+                    r += pixel[in.r];
+                    g += pixel[in.g];
+                    b += pixel[in.b];
+                    ++count;
+                }
+            }
+            r = (r + count / 2) / count;
+            g = (g + count / 2) / count;
+            b = (b + count / 2) / count;
+
+            uRow[cu.offset + cx * cu.step] = clampByte(((k.ur * r + k.ug * g + k.ub * b + 128) >> 8) + 128);
+            vRow[cv.offset + cx * cv.step] = clampByte(((k.vr * r + k.vg * g + k.vb * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+// Re-layouts YUV without touching colour: luma is copied and chroma is resampled
+// between 4:2:2 and 4:2:0 by averaging vertical pairs.
+void yuvToYuv(const ConstPlanes& src, const Planes& dst, int width, int height,
+              spa_video_format srcFormat, spa_video_format dstFormat){
+    YuvComponent in[3];
+    YuvComponent out[3];
+    int inShift = 0;
+    int outShift = 0;
+    if(!getYuvComponents(srcFormat, in, inShift) || !getYuvComponents(dstFormat, out, outShift)){
+        return;
+    }
+
+    auto planeRow = [](const YuvComponent& component, int shift, int row){
+        return component.plane == 0 ? row : (row >> shift);
+    };
+
+    for(int y = 0; y < height; ++y){
+        const uint8_t* srcRow = src.data[in[0].plane] + y * src.stride[in[0].plane];
+        uint8_t* dstRow = dst.data[out[0].plane] + y * dst.stride[out[0].plane];
+        for(int x = 0; x < width; ++x){
+            dstRow[out[0].offset + x * out[0].step] = srcRow[in[0].offset + x * in[0].step];
+        }
+    }
+
+    const int rowsPerChroma = 1 << outShift;
+    for(int y = 0; y < height; y += rowsPerChroma){
+        const int first = y;
+        const int last = std::min(y + rowsPerChroma - 1, height - 1);
+        for(int i = 1; i < 3; ++i){
+            const YuvComponent& from = in[i];
+            const YuvComponent& to = out[i];
+            const uint8_t* rowA = src.data[from.plane] + planeRow(from, inShift, first) * src.stride[from.plane];
+            const uint8_t* rowB = src.data[from.plane] + planeRow(from, inShift, last) * src.stride[from.plane];
+            uint8_t* dstRow = dst.data[to.plane] + planeRow(to, outShift, y) * dst.stride[to.plane];
+            for(int cx = 0; cx < (width + 1) / 2; ++cx){
+                const int a = rowA[from.offset + cx * from.step];
+                const int b = rowB[from.offset + cx * from.step];
+                dstRow[to.offset + cx * to.step] = static_cast<uint8_t>((a + b + 1) >> 1);
+            }
+        }
+    }
+}
+
+RowConverter::Function selectResize(){
+    switch(getKernel()){
+#if defined(OFX_PIPEWIRE_X86)
+        case Kernel::Avx2:
+            return convertResizeAvx2;
+        case Kernel::Ssse3:
+            return convertResizeSsse3;
+#endif
+#if defined(OFX_PIPEWIRE_NEON)
+        case Kernel::Neon:
+            return convertNeon;
+#endif
+        default:
+            return convertScalar;
+    }
+}
+
+RowConverter::Function selectSwizzle4(){
+    switch(getKernel()){
+#if defined(OFX_PIPEWIRE_X86)
+        case Kernel::Avx2:
+            return convertAvx2;
+        case Kernel::Ssse3:
+            return convertSsse3;
+#endif
+#if defined(OFX_PIPEWIRE_NEON)
+        case Kernel::Neon:
+            return convertNeon;
+#endif
+        default:
+            return convertScalar;
+    }
+}
+
+// Byte offset of pixel (x, y) within one plane.
+size_t getPlaneOffset(spa_video_format format, int plane, int stride, int x, int y){
+    PackedLayout packed;
+    if(getPackedLayout(format, packed)){
+        return static_cast<size_t>(y) * stride + static_cast<size_t>(x) * packed.bytesPerPixel;
+    }
+    switch(format){
+        case SPA_VIDEO_FORMAT_NV12:
+            return plane == 0 ? static_cast<size_t>(y) * stride + x : static_cast<size_t>(y / 2) * stride + (x / 2) * 2;
+        case SPA_VIDEO_FORMAT_I420:
+            return plane == 0 ? static_cast<size_t>(y) * stride + x : static_cast<size_t>(y / 2) * stride + x / 2;
+        case SPA_VIDEO_FORMAT_YUY2:
+        case SPA_VIDEO_FORMAT_UYVY:
+            return static_cast<size_t>(y) * stride + (x / 2) * 4;
+        default:
+            return 0;
+    }
+}
+
+// Bytes one row of a width-pixel block covers in one plane.
+size_t getBlockRowBytes(spa_video_format format, int plane, int width){
+    PackedLayout packed;
+    if(getPackedLayout(format, packed)){
+        return static_cast<size_t>(width) * packed.bytesPerPixel;
+    }
+    switch(format){
+        case SPA_VIDEO_FORMAT_NV12:
+            return plane == 0 ? width : ((width + 1) / 2) * 2;
+        case SPA_VIDEO_FORMAT_I420:
+            return plane == 0 ? width : (width + 1) / 2;
+        case SPA_VIDEO_FORMAT_YUY2:
+        case SPA_VIDEO_FORMAT_UYVY:
+            return ((width + 1) / 2) * 4;
+        default:
+            return 0;
+    }
+}
+
+}
+
+bool isYuvFormat(spa_video_format format){
+    switch(format){
+        case SPA_VIDEO_FORMAT_NV12:
+        case SPA_VIDEO_FORMAT_I420:
+        case SPA_VIDEO_FORMAT_YUY2:
+        case SPA_VIDEO_FORMAT_UYVY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool getPlaneLayout(spa_video_format format, int width, int height, uint32_t stride, PlaneLayout& layout){
+    auto roundUp4 = [](uint32_t value){
+        return (value + 3u) & ~3u;
+    };
+
+    layout = PlaneLayout();
+    const uint32_t w = static_cast<uint32_t>(width);
+    const uint32_t h = static_cast<uint32_t>(height);
+    const uint32_t chromaHeight = (h + 1) / 2;
+
+    PackedLayout packed;
+    if(getPackedLayout(format, packed)){
+        layout.count = 1;
+        layout.stride[0] = stride > 0 ? stride : roundUp4(w * packed.bytesPerPixel);
+        layout.height[0] = h;
+    }else{
+        switch(format){
+            case SPA_VIDEO_FORMAT_NV12:
+                layout.count = 2;
+                layout.stride[0] = stride > 0 ? stride : roundUp4(w);
+                layout.stride[1] = layout.stride[0];
+                layout.height[0] = h;
+                layout.height[1] = chromaHeight;
+                break;
+            case SPA_VIDEO_FORMAT_I420:
+                layout.count = 3;
+                layout.stride[0] = stride > 0 ? stride : roundUp4(w);
+                layout.stride[1] = stride > 0 ? stride / 2 : roundUp4((w + 1) / 2);
+                layout.stride[2] = layout.stride[1];
+                layout.height[0] = h;
+                layout.height[1] = chromaHeight;
+                layout.height[2] = chromaHeight;
+                break;
+            case SPA_VIDEO_FORMAT_YUY2:
+            case SPA_VIDEO_FORMAT_UYVY:
+                layout.count = 1;
+                layout.stride[0] = stride > 0 ? stride : roundUp4(((w + 1) / 2) * 4);
+                layout.height[0] = h;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    for(int i = 0; i < layout.count; ++i){
+        layout.offset[i] = static_cast<uint32_t>(layout.size);
+        layout.size += static_cast<size_t>(layout.stride[i]) * layout.height[i];
+    }
+    return true;
+}
+
+ConstPlanes makePlanes(const uint8_t* base, const PlaneLayout& layout){
+    ConstPlanes planes;
+    for(int i = 0; i < layout.count; ++i){
+        planes.data[i] = base + layout.offset[i];
+        planes.stride[i] = static_cast<int>(layout.stride[i]);
+    }
+    return planes;
+}
+
+Planes makePlanes(uint8_t* base, const PlaneLayout& layout){
+    Planes planes;
+    for(int i = 0; i < layout.count; ++i){
+        planes.data[i] = base + layout.offset[i];
+        planes.stride[i] = static_cast<int>(layout.stride[i]);
+    }
+    return planes;
+}
+
+void copyPlanes(const ConstPlanes& src, const Planes& dst, const PlaneLayout& layout){
+    for(int i = 0; i < layout.count; ++i){
+        const size_t rowBytes = static_cast<size_t>(std::min(src.stride[i], dst.stride[i]));
+        if(src.stride[i] == dst.stride[i]){
+            memcpy(dst.data[i], src.data[i], rowBytes * layout.height[i]);
+            continue;
+        }
+        for(uint32_t y = 0; y < layout.height[i]; ++y){
+            memcpy(dst.data[i] + y * dst.stride[i], src.data[i] + y * src.stride[i], rowBytes);
+        }
+    }
+}
+
+ConstPlanes offsetPlanes(const ConstPlanes& planes, spa_video_format format, int x, int y){
+    ConstPlanes result = planes;
+    for(int i = 0; i < 3; ++i){
+        if(result.data[i]){
+            result.data[i] += getPlaneOffset(format, i, planes.stride[i], x, y);
+        }
+    }
+    return result;
+}
+
+Planes offsetPlanes(const Planes& planes, spa_video_format format, int x, int y){
+    Planes result = planes;
+    for(int i = 0; i < 3; ++i){
+        if(result.data[i]){
+            result.data[i] += getPlaneOffset(format, i, planes.stride[i], x, y);
+        }
+    }
+    return result;
+}
+
+void copyBlock(const ConstPlanes& src, const Planes& dst, spa_video_format format, int width, int height){
+    for(int i = 0; i < 3 && src.data[i] && dst.data[i]; ++i){
+        const size_t rowBytes = getBlockRowBytes(format, i, width);
+        const int rows = i == 0 ? height : (height + 1) / 2;
+        for(int y = 0; y < rows; ++y){
+            memcpy(dst.data[i] + y * dst.stride[i], src.data[i] + y * src.stride[i], rowBytes);
+        }
+    }
+}
+
+ColorMatrix toColorMatrix(spa_video_color_matrix matrix, int height){
+    switch(matrix){
+        case SPA_VIDEO_COLOR_MATRIX_BT709:
+            return ColorMatrix::BT709;
+        case SPA_VIDEO_COLOR_MATRIX_BT601:
+            return ColorMatrix::BT601;
+        default:
+            return height >= 720 ? ColorMatrix::BT709 : ColorMatrix::BT601;
+    }
+}
+
+ColorRange toColorRange(spa_video_color_range range){
+    return range == SPA_VIDEO_COLOR_RANGE_0_255 ? ColorRange::Full : ColorRange::Limited;
+}
+
+void clearPlanes(const Planes& dst, spa_video_format format, const PlaneLayout& layout, ColorRange range){
+    const uint8_t black = range == ColorRange::Full ? 0 : 16;
+    YuvComponent components[3];
+    int chromaRowShift = 0;
+    if(!getYuvComponents(format, components, chromaRowShift)){
+        for(int i = 0; i < layout.count; ++i){
+            memset(dst.data[i], 0, static_cast<size_t>(dst.stride[i]) * layout.height[i]);
+        }
+        return;
+    }
+
+    if(components[0].step == 1){
+        for(int i = 0; i < layout.count; ++i){
+            memset(dst.data[i], i == 0 ? black : 128, static_cast<size_t>(dst.stride[i]) * layout.height[i]);
+        }
+        return;
+    }
+
+    // Packed 4:2:2 alternates luma and chroma bytes.
+    const int lumaOffset = components[0].offset;
+    for(uint32_t y = 0; y < layout.height[0]; ++y){
+        uint8_t* row = dst.data[0] + y * dst.stride[0];
+        for(int x = 0; x + 1 < dst.stride[0]; x += 2){
+            row[x + lumaOffset] = black;
+            row[x + 1 - lumaOffset] = 128;
+        }
+    }
+}
+
+bool getPackedLayout(spa_video_format format, PackedLayout& layout){
+    switch(format){
+        case SPA_VIDEO_FORMAT_RGBA:
+            layout = {4, 0, 1, 2, 3};
+            return true;
+        case SPA_VIDEO_FORMAT_BGRA:
+            layout = {4, 2, 1, 0, 3};
+            return true;
+        case SPA_VIDEO_FORMAT_RGBx:
+            layout = {4, 0, 1, 2, -1};
+            return true;
+        case SPA_VIDEO_FORMAT_BGRx:
+            layout = {4, 2, 1, 0, -1};
+            return true;
+        case SPA_VIDEO_FORMAT_RGB:
+            layout = {3, 0, 1, 2, -1};
+            return true;
+        case SPA_VIDEO_FORMAT_BGR:
+            layout = {3, 2, 1, 0, -1};
+            return true;
+        case SPA_VIDEO_FORMAT_GRAY8:
+            layout = {1, 0, 0, 0, -1};
+            return true;
+        default:
+            return false;
+    }
+}
+
+void RowConverter::convertRows(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) const{
+    // Tightly packed frames are converted as one long row.
+    if(srcStride == width * srcBytesPerPixel && dstStride == width * dstBytesPerPixel){
+        function(src, dst, width * height, *this);
+        return;
+    }
+
+    for(int y = 0; y < height; ++y){
+        function(src + y * srcStride, dst + y * dstStride, width, *this);
+    }
+}
+
+RowConverter getRowConverter(spa_video_format srcFormat, spa_video_format dstFormat){
+    RowConverter converter;
+    PackedLayout src;
+    PackedLayout dst;
+    if(!getPackedLayout(srcFormat, src) || !getPackedLayout(dstFormat, dst)){
+        return converter;
+    }
+
+    converter.srcBytesPerPixel = src.bytesPerPixel;
+    converter.dstBytesPerPixel = dst.bytesPerPixel;
+
+    if(srcFormat == dstFormat){
+        for(int i = 0; i < dst.bytesPerPixel; ++i){
+            converter.map[i] = static_cast<uint8_t>(i);
+        }
+        converter.function = copyRow;
+        return converter;
+    }
+
+    if(dst.bytesPerPixel == 1){
+        converter.map[0] = static_cast<uint8_t>(src.r);
+        converter.map[1] = static_cast<uint8_t>(src.g);
+        converter.map[2] = static_cast<uint8_t>(src.b);
+        converter.function = convertToGrayScalar;
+        return converter;
+    }
+
+    for(int i = 0; i < dst.bytesPerPixel; ++i){
+        int index = -1;
+        if(i == dst.r){
+            index = src.r;
+        }else if(i == dst.g){
+            index = src.g;
+        }else if(i == dst.b){
+            index = src.b;
+        }else if(i == dst.a){
+            index = src.a;
+        }
+        converter.map[i] = index < 0 ? RowConverter::fillByte : static_cast<uint8_t>(index);
+    }
+
+    // Unused trailing bytes (3-byte output) shuffle in zero and are overwritten by the next step.
+    memset(converter.shuffle, 0x80, sizeof(converter.shuffle));
+    for(int pixel = 0; pixel < 4; ++pixel){
+        for(int i = 0; i < dst.bytesPerPixel; ++i){
+            const uint8_t index = converter.map[i];
+            const bool filled = index == RowConverter::fillByte;
+            const int byte = pixel * dst.bytesPerPixel + i;
+            converter.shuffle[byte] = filled ? 0x80 : static_cast<uint8_t>(pixel * src.bytesPerPixel + index);
+            converter.fill[byte] = filled ? 0xFF : 0x00;
+        }
+    }
+    converter.function = src.bytesPerPixel == 4 && dst.bytesPerPixel == 4 ? selectSwizzle4() : selectResize();
+
+    return converter;
+}
+
+void FrameConverter::convert(const ConstPlanes& src, const Planes& dst, int width, int height) const{
+    switch(kind){
+        case Kind::Packed:
+            row.convertRows(src.data[0], src.stride[0], dst.data[0], dst.stride[0], width, height);
+            break;
+        case Kind::YuvToPacked:
+            for(int y = 0; y < height; ++y){
+                const uint8_t* rows[3];
+                for(int i = 0; i < 3; ++i){
+                    const int plane = yuv.components[i].plane;
+                    const int planeRow = plane == 0 ? y : (y >> yuv.chromaRowShift);
+                    rows[i] = src.data[plane] + planeRow * src.stride[plane];
+                }
+                yuv.function(rows, dst.data[0] + y * dst.stride[0], width, yuv);
+            }
+            break;
+        case Kind::PackedToYuv:
+            packedToYuv(src, dst, width, height, packed, yuvFormat, matrix, range);
+            break;
+        case Kind::YuvToYuv:
+            if(srcFormat == yuvFormat){
+                copyBlock(src, dst, srcFormat, width, height);
+            }else{
+                yuvToYuv(src, dst, width, height, srcFormat, yuvFormat);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+FrameConverter getFrameConverter(spa_video_format srcFormat, spa_video_format dstFormat,
+                                 ColorMatrix matrix, ColorRange range){
+    FrameConverter converter;
+    PackedLayout src;
+    PackedLayout dst;
+    const bool srcPacked = getPackedLayout(srcFormat, src);
+    const bool dstPacked = getPackedLayout(dstFormat, dst);
+
+    if(srcPacked && dstPacked){
+        converter.row = getRowConverter(srcFormat, dstFormat);
+        converter.kind = FrameConverter::Kind::Packed;
+    }else if(isYuvFormat(srcFormat) && dstPacked){
+        YuvConverter& yuv = converter.yuv;
+        yuv.dstBytesPerPixel = dst.bytesPerPixel;
+        getYuvComponents(srcFormat, yuv.components, yuv.chromaRowShift);
+        yuv.coefficients = getYuvCoefficients(matrix, range);
+        yuv.r = dst.r;
+        yuv.g = dst.g;
+        yuv.b = dst.b;
+        for(int i = 0; i < 3; ++i){
+            const YuvComponent& component = yuv.components[i];
+            const bool chroma = i > 0;
+            yuv.advance[i] = (chroma ? 4 : 8) * component.step;
+            for(int pixel = 0; pixel < 16; ++pixel){
+                const int index = component.offset + (chroma ? (pixel >> 1) : pixel) * component.step;
+                yuv.gather[i][pixel] = pixel < 8 ? static_cast<uint8_t>(index) : 0x80;
+            }
+        }
+        yuv.function = selectYuvToPacked(dst.bytesPerPixel);
+        converter.kind = FrameConverter::Kind::YuvToPacked;
+    }else if(srcPacked && isYuvFormat(dstFormat)){
+        converter.packed = src;
+        converter.yuvFormat = dstFormat;
+        converter.kind = FrameConverter::Kind::PackedToYuv;
+    }else if(isYuvFormat(srcFormat) && isYuvFormat(dstFormat)){
+        converter.yuvFormat = dstFormat;
+        converter.kind = FrameConverter::Kind::YuvToYuv;
+    }
+
+    converter.srcFormat = srcFormat;
+    converter.dstFormat = dstFormat;
+    converter.matrix = matrix;
+    converter.range = range;
+    return converter;
+}
+
+const char* getKernelName(){
+    switch(getKernel()){
+        case Kernel::Avx2:
+            return "AVX2";
+        case Kernel::Ssse3:
+            return "SSSE3";
+        case Kernel::Neon:
+            return "NEON";
+        default:
+            return "scalar";
+    }
+}
+
+}
+
+#endif
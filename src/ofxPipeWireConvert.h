@@ -0,0 +1,201 @@
+#pragma once
+
+#include "ofConstants.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef TARGET_LINUX
+#include <spa/param/video/raw.h>
+
+namespace ofxPipeWireConvert {
+
+// Byte layout of a packed RGB format. Offsets are -1 when a channel is absent.
+struct PackedLayout {
+    int bytesPerPixel = 0;
+    int r = -1;
+    int g = -1;
+    int b = -1;
+    int a = -1;
+};
+
+bool getPackedLayout(spa_video_format format, PackedLayout& layout);
+bool isYuvFormat(spa_video_format format);
+
+// Memory layout of a frame whose planes live back to back in one block.
+struct PlaneLayout {
+    int count = 0;
+    uint32_t stride[3] = {0, 0, 0};
+    uint32_t offset[3] = {0, 0, 0};
+    uint32_t height[3] = {0, 0, 0};
+    size_t size = 0;
+};
+
+// A stride of 0 picks the default (4-byte aligned rows); otherwise it is the
+// first plane's stride and the chroma strides are derived from it.
+bool getPlaneLayout(spa_video_format format, int width, int height, uint32_t stride, PlaneLayout& layout);
+
+struct Planes {
+    uint8_t* data[3] = {nullptr, nullptr, nullptr};
+    int stride[3] = {0, 0, 0};
+};
+
+struct ConstPlanes {
+    const uint8_t* data[3] = {nullptr, nullptr, nullptr};
+    int stride[3] = {0, 0, 0};
+
+    ConstPlanes() = default;
+    ConstPlanes(const Planes& planes){
+        for(int i = 0; i < 3; ++i){
+            data[i] = planes.data[i];
+            stride[i] = planes.stride[i];
+        }
+    }
+};
+
+ConstPlanes makePlanes(const uint8_t* base, const PlaneLayout& layout);
+Planes makePlanes(uint8_t* base, const PlaneLayout& layout);
+
+// Copies every plane row by row; rows are clipped to the shorter stride.
+void copyPlanes(const ConstPlanes& src, const Planes& dst, const PlaneLayout& layout);
+
+// Moves each plane pointer to pixel (x, y). Subsampled formats need even x and y.
+ConstPlanes offsetPlanes(const ConstPlanes& planes, spa_video_format format, int x, int y);
+Planes offsetPlanes(const Planes& planes, spa_video_format format, int x, int y);
+
+// Copies a width x height block of every plane, starting at the plane pointers.
+void copyBlock(const ConstPlanes& src, const Planes& dst, spa_video_format format, int width, int height);
+
+enum class ColorMatrix {
+    BT601,
+    BT709
+};
+
+enum class ColorRange {
+    Limited,
+    Full
+};
+
+// Unknown colorimetry falls back to BT.601 for SD and BT.709 for HD, limited range.
+ColorMatrix toColorMatrix(spa_video_color_matrix matrix, int height);
+ColorRange toColorRange(spa_video_color_range range);
+
+// Fills a frame with black: zero bytes for RGB, the black level plus neutral chroma for YUV.
+void clearPlanes(const Planes& dst, spa_video_format format, const PlaneLayout& layout, ColorRange range);
+
+// Converts rows between two packed formats of 1, 3 or 4 bytes per pixel. Which kernel
+// runs (scalar, SSSE3, AVX2 or NEON) is decided once, when the converter is created,
+// never per pixel. Converting to GRAY8 computes luma.
+struct RowConverter {
+    using Function = void (*)(const uint8_t* src, uint8_t* dst, int width, const RowConverter& converter);
+
+    Function function = nullptr;
+    int srcBytesPerPixel = 0;
+    int dstBytesPerPixel = 0;
+    // For each destination byte of one pixel: source byte index, or fillByte for a constant 255.
+    uint8_t map[4] = {0, 0, 0, 0};
+    // The mapping for four pixels laid out for byte-shuffle kernels.
+    alignas(16) uint8_t shuffle[16] = {};
+    alignas(16) uint8_t fill[16] = {};
+
+    static constexpr uint8_t fillByte = 0x80;
+
+    bool isValid() const{
+        return function != nullptr;
+    }
+
+    void convertRow(const uint8_t* src, uint8_t* dst, int width) const{
+        function(src, dst, width, *this);
+    }
+
+    void convertRows(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) const;
+};
+
+RowConverter getRowConverter(spa_video_format srcFormat, spa_video_format dstFormat);
+
+// Where one of Y, U or V sits: which plane, the byte offset of the first
+// sample, and the byte step between samples. Chroma is shared by two pixels.
+struct YuvComponent {
+    int plane = 0;
+    int offset = 0;
+    int step = 1;
+};
+
+// Integer BT.601/BT.709 coefficients scaled by 256.
+struct YuvCoefficients {
+    int yOffset = 16;
+    int y = 298;
+    int rv = 409;
+    int gu = 100;
+    int gv = 208;
+    int bu = 516;
+};
+
+struct YuvConverter {
+    using Function = void (*)(const uint8_t* const rows[3], uint8_t* dst, int width, const YuvConverter& converter);
+
+    Function function = nullptr;
+    YuvComponent components[3];
+    // Rows of planes 1 and 2 are shifted by this much (1 for 4:2:0).
+    int chromaRowShift = 0;
+    YuvCoefficients coefficients;
+    // 1 (luma only), 3 or 4. R, G and B land at these byte positions; a 4th byte is 255.
+    int dstBytesPerPixel = 4;
+    int r = 0;
+    int g = 1;
+    int b = 2;
+    // Per component: bytes consumed per 8 pixels and the byte-shuffle gather pattern.
+    int advance[3] = {0, 0, 0};
+    alignas(16) uint8_t gather[3][16] = {};
+};
+
+// Converts whole frames between any supported pair of formats in one pass.
+// YUV to YUV only changes layout and subsampling, never colour. YUV to packed runs
+// scalar, SSSE3, AVX2 or NEON kernels; packed to YUV runs SSSE3 on x86 (also on AVX2
+// CPUs) and is scalar elsewhere, NEON included.
+class FrameConverter {
+public:
+    bool isValid() const{
+        return kind != Kind::None;
+    }
+
+    void convert(const ConstPlanes& src, const Planes& dst, int width, int height) const;
+
+    spa_video_format getSourceFormat() const{
+        return srcFormat;
+    }
+    spa_video_format getTargetFormat() const{
+        return dstFormat;
+    }
+
+private:
+    friend FrameConverter getFrameConverter(spa_video_format, spa_video_format, ColorMatrix, ColorRange);
+
+    enum class Kind {
+        None,
+        Packed,
+        YuvToPacked,
+        PackedToYuv,
+        YuvToYuv
+    };
+
+    Kind kind = Kind::None;
+    spa_video_format srcFormat = SPA_VIDEO_FORMAT_UNKNOWN;
+    spa_video_format dstFormat = SPA_VIDEO_FORMAT_UNKNOWN;
+    RowConverter row;
+    YuvConverter yuv;
+    PackedLayout packed;
+    spa_video_format yuvFormat = SPA_VIDEO_FORMAT_UNKNOWN;
+    ColorMatrix matrix = ColorMatrix::BT601;
+    ColorRange range = ColorRange::Limited;
+};
+
+FrameConverter getFrameConverter(spa_video_format srcFormat, spa_video_format dstFormat,
+                                 ColorMatrix matrix = ColorMatrix::BT601, ColorRange range = ColorRange::Limited);
+
+// Name of the kernel family picked for this CPU, for logging.
+const char* getKernelName();
+
+}
+
+#endif